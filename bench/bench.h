@@ -0,0 +1,105 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*Shared plumbing for the palloc2 benchmarks.
+  Every benchmark is an ordinary program linked against the system malloc;
+  the allocator under test is selected at run time with LD_PRELOAD
+  (see run_bench.sh).*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static inline double bench_now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC,&ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*xorshift64*: cheap enough that it doesn't show up next to malloc.*/
+static inline uint64_t bench_random(uint64_t* state)
+{
+     uint64_t x = *state;
+     x ^= x >> 12;
+     x ^= x << 25;
+     x ^= x >> 27;
+     *state = x;
+     return x * 0x2545F4914F6CDD1DULL;
+}
+
+/*Returns the value of a "Vm..." field of /proc/self/status in kB, or -1.
+  Uses plain stdio so the numbers include whatever the allocator under test did to us.*/
+static long bench_status_kb(const char* field)
+{
+     FILE* status = fopen("/proc/self/status","r");
+     char line[256];
+     size_t field_length = strlen(field);
+     long to_return = -1;
+
+     if(!status)
+          return -1;
+     while(fgets(line,sizeof(line),status))
+          if(!strncmp(line,field,field_length) && line[field_length]==':')
+          {
+               to_return = strtol(line + field_length + 1,NULL,10);
+               break;
+          }
+     fclose(status);
+     return to_return;
+}
+
+/*One line per run so run_bench.sh can tabulate the output.*/
+static void bench_report(const char* name, int threads, uint64_t ops, double seconds)
+{
+     printf("%-14s threads=%-4d ops/sec=%-14.0f peak_rss_kb=%-10ld vm_peak_kb=%-10ld vm_kb=%ld\n",
+            name,threads,ops / seconds,
+            bench_status_kb("VmHWM"),bench_status_kb("VmPeak"),bench_status_kb("VmSize"));
+}
+
+static int bench_arg(int argc, char** argv, int index, int fallback)
+{
+     return argc > index ? atoi(argv[index]) : fallback;
+}
+
+/*Runs nthreads copies of worker, each handed &args[i*arg_size].
+  The workers wait on bench_start_barrier so that thread creation is not timed.
+  Returns the wall clock time between releasing the barrier and the last join.*/
+static pthread_barrier_t bench_start_barrier;
+
+static double bench_run_threads(int nthreads, void* (*worker)(void*), void* args, size_t arg_size)
+{
+     pthread_t* tids = malloc(sizeof(pthread_t)*nthreads);
+     int i;
+     double start;
+
+     pthread_barrier_init(&bench_start_barrier,NULL,nthreads+1);
+     for(i=0; i<nthreads; i++)
+          if(pthread_create(tids+i,NULL,worker,(char*)args + i*arg_size))
+          {
+               perror("pthread_create");
+               exit(1);
+          }
+
+     pthread_barrier_wait(&bench_start_barrier);
+     start = bench_now();
+     for(i=0; i<nthreads; i++)
+          pthread_join(tids[i],NULL);
+
+     pthread_barrier_destroy(&bench_start_barrier);
+     free(tids);
+     return bench_now() - start;
+}
+
+/*Keep the compiler from optimizing away writes to memory we're about to free.*/
+static inline void bench_touch(void* ptr, size_t size)
+{
+     memset(ptr,(int)(size & 0xff),size < 64 ? size : 64);
+     __asm__ volatile("" : : "r"(ptr) : "memory");
+}
+
+#endif
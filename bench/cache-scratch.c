@@ -0,0 +1,54 @@
+/*cache-scratch, after the Hoard benchmark of the same name.
+  The main thread allocates one small object per worker back to back, so they tend
+  to share cache lines, and hands them out.  Each worker frees its object and then
+  repeatedly allocates, writes and frees an object of the same size.  An allocator
+  that hands the freed neighbours back to different threads causes passive false sharing.
+
+  usage: cache-scratch [threads] [iterations] [size] [writes_per_object]*/
+
+#include "bench.h"
+
+struct scratch_args
+{
+     char* initial;
+};
+
+static int iterations, size, writes;
+
+static void* scratch_worker(void* arg_)
+{
+     struct scratch_args* arg = (struct scratch_args*)(arg_);
+     int i, j, k;
+
+     pthread_barrier_wait(&bench_start_barrier);
+     free(arg->initial);
+     for(i=0; i<iterations; i++)
+     {
+          volatile char* object = malloc(size);
+          for(j=0; j<writes; j++)
+               for(k=0; k<size; k++)
+                    object[k] = (char)(j+k);
+          free((void*)(object));
+     }
+     return NULL;
+}
+
+int main(int argc, char** argv)
+{
+     int nthreads = bench_arg(argc,argv,1,1);
+     iterations = bench_arg(argc,argv,2,100000);
+     size = bench_arg(argc,argv,3,8);
+     writes = bench_arg(argc,argv,4,50);
+
+     struct scratch_args* args = malloc(sizeof(struct scratch_args)*nthreads);
+     int i;
+
+     for(i=0; i<nthreads; i++)
+          args[i].initial = malloc(size);
+
+     double seconds = bench_run_threads(nthreads,scratch_worker,args,sizeof(struct scratch_args));
+     bench_report("cache-scratch",nthreads,(uint64_t)(nthreads) * iterations * 2,seconds);
+
+     free(args);
+     return 0;
+}
@@ -0,0 +1,38 @@
+/*cache-thrash, after the Hoard benchmark of the same name.
+  Every worker repeatedly allocates, writes and frees its own small object.
+  An allocator that places concurrently live objects of different threads on the
+  same cache line causes active false sharing.
+
+  usage: cache-thrash [threads] [iterations] [size] [writes_per_object]*/
+
+#include "bench.h"
+
+static int iterations, size, writes;
+
+static void* thrash_worker(void* arg)
+{
+     int i, j, k;
+
+     pthread_barrier_wait(&bench_start_barrier);
+     for(i=0; i<iterations; i++)
+     {
+          volatile char* object = malloc(size);
+          for(j=0; j<writes; j++)
+               for(k=0; k<size; k++)
+                    object[k] = (char)(j+k);
+          free((void*)(object));
+     }
+     return NULL;
+}
+
+int main(int argc, char** argv)
+{
+     int nthreads = bench_arg(argc,argv,1,1);
+     iterations = bench_arg(argc,argv,2,100000);
+     size = bench_arg(argc,argv,3,8);
+     writes = bench_arg(argc,argv,4,50);
+
+     double seconds = bench_run_threads(nthreads,thrash_worker,NULL,0);
+     bench_report("cache-thrash",nthreads,(uint64_t)(nthreads) * iterations * 2,seconds);
+     return 0;
+}
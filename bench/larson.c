@@ -0,0 +1,81 @@
+/*Larson server simulation.
+  Each thread owns a table of live objects and randomly replaces entries in it.
+  Between rounds the tables are passed on to the next thread, the way a server
+  hands connections between workers, so a steady fraction of frees is remote.
+
+  usage: larson [threads] [rounds] [ops_per_round] [slots_per_thread] [min_size] [max_size]*/
+
+#include "bench.h"
+
+struct larson_args
+{
+     int id;
+};
+
+static int nthreads, rounds, ops_per_round, slots, min_size, max_size;
+static void*** tables;
+static pthread_barrier_t round_barrier;
+
+static void* larson_worker(void* arg_)
+{
+     struct larson_args* arg = (struct larson_args*)(arg_);
+     uint64_t state = 0x9E3779B97F4A7C15ULL * (arg->id + 1);
+     int round, i;
+
+     pthread_barrier_wait(&bench_start_barrier);
+     for(round=0; round<rounds; round++)
+     {
+          void** table = tables[(arg->id + round) % nthreads];
+          for(i=0; i<ops_per_round; i++)
+          {
+               int victim = bench_random(&state) % slots;
+               size_t size = min_size + bench_random(&state) % (max_size - min_size + 1);
+               free(table[victim]);
+               table[victim] = malloc(size);
+               bench_touch(table[victim],size);
+          }
+          pthread_barrier_wait(&round_barrier);
+     }
+     return NULL;
+}
+
+int main(int argc, char** argv)
+{
+     nthreads = bench_arg(argc,argv,1,1);
+     rounds = bench_arg(argc,argv,2,20);
+     ops_per_round = bench_arg(argc,argv,3,100000);
+     slots = bench_arg(argc,argv,4,1000);
+     min_size = bench_arg(argc,argv,5,8);
+     max_size = bench_arg(argc,argv,6,512);
+
+     struct larson_args* args = malloc(sizeof(struct larson_args)*nthreads);
+     uint64_t state = 42;
+     int i, j;
+
+     tables = malloc(sizeof(void**)*nthreads);
+     for(i=0; i<nthreads; i++)
+     {
+          args[i].id = i;
+          tables[i] = malloc(sizeof(void*)*slots);
+          for(j=0; j<slots; j++)
+          {
+               size_t size = min_size + bench_random(&state) % (max_size - min_size + 1);
+               tables[i][j] = malloc(size);
+               bench_touch(tables[i][j],size);
+          }
+     }
+
+     pthread_barrier_init(&round_barrier,NULL,nthreads);
+     double seconds = bench_run_threads(nthreads,larson_worker,args,sizeof(struct larson_args));
+     bench_report("larson",nthreads,(uint64_t)(nthreads) * rounds * ops_per_round * 2,seconds);
+
+     for(i=0; i<nthreads; i++)
+     {
+          for(j=0; j<slots; j++)
+               free(tables[i][j]);
+          free(tables[i]);
+     }
+     free(tables);
+     free(args);
+     return 0;
+}
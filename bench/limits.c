@@ -0,0 +1,49 @@
+/*limits: requests too big for any size class must fail with ENOMEM rather
+  than come back as some smaller chunk.  Not a benchmark; "make check" runs it
+  against palloc2.
+
+  usage: limits*/
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int failures;
+static volatile size_t too_big = SIZE_MAX; /*volatile keeps -Walloc-size-larger-than quiet*/
+
+static void expect_enomem(const char* call, void* result)
+{
+     if(result || errno!=ENOMEM)
+     {
+          printf("FAIL %s returned %p with errno %d\n",call,result,errno);
+          failures++;
+     }
+     errno = 0;
+}
+
+int main()
+{
+     void* ptr = malloc(16);
+     void* aligned;
+
+     errno = 0;
+     expect_enomem("malloc(SIZE_MAX)",malloc(too_big));
+     expect_enomem("malloc(SIZE_MAX/2+1)",malloc(too_big / 2 + 1));
+     expect_enomem("malloc(1<<40)",malloc((size_t)(1) << 40));
+     expect_enomem("calloc(1,SIZE_MAX)",calloc(1,too_big));
+     expect_enomem("calloc(SIZE_MAX/2,4)",calloc(too_big / 2,4));
+     expect_enomem("aligned_alloc(64,SIZE_MAX)",aligned_alloc(64,too_big));
+     expect_enomem("memalign(4096,SIZE_MAX-4096)",memalign(4096,too_big - 4096));
+     if(posix_memalign(&aligned,64,too_big)!=ENOMEM)
+     {
+          puts("FAIL posix_memalign(&aligned,64,SIZE_MAX) did not return ENOMEM");
+          failures++;
+     }
+     expect_enomem("realloc(ptr,SIZE_MAX)",realloc(ptr,too_big));
+     free(ptr);
+
+     puts(failures ? "limits: FAILED" : "limits: ok");
+     return failures!=0;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+#Runs the benchmark suite against palloc2, glibc and any other allocator
+#at 1 to N threads.
+#
+#  MAX_THREADS   highest thread count to run (default: number of CPUs)
+#  ALLOCATORS    extra shared objects to LD_PRELOAD, separated by spaces,
+#                e.g. ALLOCATORS="/usr/lib/libjemalloc.so.2 /usr/lib/libtcmalloc.so"
+#  BENCHMARKS    subset of benchmarks to run (default: all of them)
+#
+#Any arguments are passed through to every benchmark after the thread count.
+
+cd "$(dirname "$0")" || exit 1
+
+MAX_THREADS=${MAX_THREADS:-$(nproc)}
+BENCHMARKS=${BENCHMARKS:-"larson threadtest xmalloc cache-scratch cache-thrash size-sweep"}
+PALLOC2=$(cd .. && pwd)/libPALLOC2.so
+
+for allocator in glibc "$PALLOC2" $ALLOCATORS
+do
+     if [ "$allocator" = glibc ]
+     then
+          preload=
+     else
+          preload=$allocator
+     fi
+     echo "== $(basename "$allocator")"
+     for benchmark in $BENCHMARKS
+     do
+          threads=1
+          while [ "$threads" -le "$MAX_THREADS" ]
+          do
+               LD_PRELOAD=$preload ./"$benchmark" "$threads" "$@" || echo "$benchmark threads=$threads FAILED ($?)"
+               if [ "$threads" -lt "$MAX_THREADS" ] && [ $((threads * 2)) -gt "$MAX_THREADS" ]
+               then
+                    threads=$MAX_THREADS
+               else
+                    threads=$((threads * 2))
+               fi
+          done
+     done
+done
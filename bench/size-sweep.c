@@ -0,0 +1,65 @@
+/*Size-class sweep.
+  For every palloc2 size class up to max_size, each thread allocates a batch of
+  objects of exactly that size (capped at batch_bytes per batch), writes them and
+  frees them again.  Prints one line per class followed by the total.
+
+  usage: size-sweep [threads] [iterations] [max_size] [batch_bytes]*/
+
+#include "bench.h"
+#include "../palloc_config.h"
+
+static int iterations;
+static size_t current_size, batch_bytes;
+
+static void* sweep_worker(void* arg)
+{
+     size_t objects = max(1,batch_bytes / current_size);
+     void** batch = malloc(sizeof(void*)*objects);
+     size_t j;
+     int i;
+
+     pthread_barrier_wait(&bench_start_barrier);
+     for(i=0; i<iterations; i++)
+     {
+          for(j=0; j<objects; j++)
+          {
+               batch[j] = malloc(current_size);
+               bench_touch(batch[j],current_size);
+          }
+          for(j=0; j<objects; j++)
+               free(batch[j]);
+     }
+     free(batch);
+     return NULL;
+}
+
+int main(int argc, char** argv)
+{
+     int nthreads = bench_arg(argc,argv,1,1);
+     iterations = bench_arg(argc,argv,2,20);
+     size_t max_size = (size_t)(bench_arg(argc,argv,3,64 << 20));
+     batch_bytes = (size_t)(bench_arg(argc,argv,4,1 << 20));
+
+     uint64_t total_ops = 0;
+     double total_seconds = 0;
+     int size_class;
+
+     for(size_class=0; size_class<NUM_PALLOC_BUCKETS; size_class++)
+     {
+          char name[32];
+          if(PALLOC_CLASS_SUBCLASS(size_class) && !PALLOC_ORDER_HAS_SUBCLASSES(PALLOC_CLASS_ORDER(size_class)))
+               continue;
+          current_size = palloc_class_size(size_class);
+          if(current_size > max_size)
+               break;
+
+          uint64_t ops = (uint64_t)(nthreads) * iterations * max(1,batch_bytes / current_size) * 2;
+          double seconds = bench_run_threads(nthreads,sweep_worker,NULL,0);
+          snprintf(name,sizeof(name),"size-%zu",current_size);
+          bench_report(name,nthreads,ops,seconds);
+          total_ops += ops;
+          total_seconds += seconds;
+     }
+     bench_report("size-sweep",nthreads,total_ops,total_seconds);
+     return 0;
+}
@@ -0,0 +1,41 @@
+/*threadtest, after the Hoard benchmark of the same name.
+  Every thread repeatedly allocates a batch of same-sized objects and then frees
+  the whole batch.  All frees are local, so this measures the uncontended fast path.
+
+  usage: threadtest [threads] [iterations] [objects] [size]*/
+
+#include "bench.h"
+
+static int iterations, objects, size;
+
+static void* threadtest_worker(void* arg)
+{
+     void** batch = malloc(sizeof(void*)*objects);
+     int i, j;
+
+     pthread_barrier_wait(&bench_start_barrier);
+     for(i=0; i<iterations; i++)
+     {
+          for(j=0; j<objects; j++)
+          {
+               batch[j] = malloc(size);
+               bench_touch(batch[j],size);
+          }
+          for(j=0; j<objects; j++)
+               free(batch[j]);
+     }
+     free(batch);
+     return NULL;
+}
+
+int main(int argc, char** argv)
+{
+     int nthreads = bench_arg(argc,argv,1,1);
+     iterations = bench_arg(argc,argv,2,200);
+     objects = bench_arg(argc,argv,3,10000);
+     size = bench_arg(argc,argv,4,64);
+
+     double seconds = bench_run_threads(nthreads,threadtest_worker,NULL,0);
+     bench_report("threadtest",nthreads,(uint64_t)(nthreads) * iterations * objects * 2,seconds);
+     return 0;
+}
@@ -0,0 +1,89 @@
+/*xmalloc-style producer/consumer test.
+  Threads are paired up: the producer of each pair allocates objects and hands them
+  over a bounded ring, the consumer frees them.  Every free is a remote free.
+  With an odd thread count the last producer also consumes its own objects.
+
+  usage: xmalloc [threads] [objects_per_producer] [min_size] [max_size]*/
+
+#include "bench.h"
+
+#define RING_SIZE 4096
+
+struct ring
+{
+     void* slots[RING_SIZE];
+     volatile uint64_t head __attribute__((aligned(64)));
+     volatile uint64_t tail __attribute__((aligned(64)));
+};
+
+struct xmalloc_args
+{
+     struct ring* ring;
+     int producer;
+     int consumer;
+     int id;
+};
+
+static int objects, min_size, max_size;
+
+static void* xmalloc_worker(void* arg_)
+{
+     struct xmalloc_args* arg = (struct xmalloc_args*)(arg_);
+     struct ring* ring = arg->ring;
+     uint64_t state = 0x9E3779B97F4A7C15ULL * (arg->id + 1);
+     int produced = 0, consumed = 0;
+
+     pthread_barrier_wait(&bench_start_barrier);
+     while((arg->producer && produced < objects) || (arg->consumer && consumed < objects))
+     {
+          if(arg->producer && produced < objects && ring->head - ring->tail < RING_SIZE)
+          {
+               size_t size = min_size + bench_random(&state) % (max_size - min_size + 1);
+               void* object = malloc(size);
+               bench_touch(object,size);
+               ring->slots[ring->head % RING_SIZE] = object;
+               __atomic_store_n(&ring->head,ring->head + 1,__ATOMIC_RELEASE);
+               produced++;
+          }
+          else if(arg->consumer && consumed < __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE))
+          {
+               free(ring->slots[ring->tail % RING_SIZE]);
+               __atomic_store_n(&ring->tail,ring->tail + 1,__ATOMIC_RELEASE);
+               consumed++;
+          }
+          else
+               sched_yield();
+     }
+     return NULL;
+}
+
+int main(int argc, char** argv)
+{
+     int nthreads = bench_arg(argc,argv,1,1);
+     objects = bench_arg(argc,argv,2,2000000);
+     min_size = bench_arg(argc,argv,3,8);
+     max_size = bench_arg(argc,argv,4,256);
+
+     int pairs = (nthreads + 1) / 2;
+     struct ring* rings;
+     struct xmalloc_args* args = malloc(sizeof(struct xmalloc_args)*nthreads);
+     int i;
+
+     if(posix_memalign((void**)(&rings),64,sizeof(struct ring)*pairs))
+          return 1;
+     memset(rings,0,sizeof(struct ring)*pairs);
+     for(i=0; i<nthreads; i++)
+     {
+          args[i].ring = rings + i/2;
+          args[i].producer = !(i%2);
+          args[i].consumer = i%2 || i==nthreads-1;
+          args[i].id = i;
+     }
+
+     double seconds = bench_run_threads(nthreads,xmalloc_worker,args,sizeof(struct xmalloc_args));
+     bench_report("xmalloc",nthreads,(uint64_t)(pairs) * objects * 2,seconds);
+
+     free(args);
+     free(rings);
+     return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <sys/mman.h>
@@ -14,64 +15,188 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <malloc.h>
+#include <stdio.h>
 #include "palloc_config.h"
 #include "plocklib.h"
+#include "palloc2_stats.h"
+#include "palloc2_profile.h"
+#include "palloc2_bounds.h"
+#include "palloc2_arena.h"
+#include "palloc2_batch.h"
 
 #define likely(x) __builtin_expect ((x), 1)
 #define unlikely(x) __builtin_expect ((x), 0)
 
 struct page_record;
 
-/*This structure is designed to be cachelicious.
-   Please take care to preserve this property if you modify it.*/
+/*Remote frees into one page that have not been applied yet (see PALLOC_REMOTE_BATCH_FREES).*/
+struct remote_free_batch
+{
+     struct page_record* record;
+     int frees;
+     uint64_t freed[PALLOC_BITVEC_ENTRIES]; /*one bit per chunk to free, same layout as bitmap*/
+};
+
+/*Per size class counters (see palloc2_stats.h).
+  Only the thread using a record writes its counters; they outlive the thread so totals stay right.*/
+struct class_counters
+{
+     uint64_t allocations;
+     uint64_t frees;
+     uint64_t remote_frees;
+     uint64_t superpages_mapped;
+     int64_t bytes_mapped; /*a thread can unmap superpages another one mapped*/
+};
+
+/*Freed chunks waiting for reuse by the same thread; see PALLOC_CHUNK_CACHE_CLASSES.*/
+struct chunk_cache
+{
+     void* head; /*each chunk's first word points to the next*/
+     uint64_t entries;
+};
+
+/*One per thread, about 12KB, nearly all of it arrays indexed by size class.
+  A malloc or free served by the chunk cache touches just two lines of it: chunk_caches[size_class],
+  which comes first, and counters[size_class].  The buckets, bins and remote batches are only for the
+  slower paths, and the fields other threads write (threadlock, trim_requested, huge_lock, remote_pages)
+  sit away from both hot arrays.  Keep anything new the fast paths need next to chunk_caches.*/
 struct thread_record
 {
-     //The *2 is because the first NUM_PALLOC_BUCKETS are head pointers; last NUM_PALLOC_BUCKETS are tail pointers
-     struct page_record* buckets[NUM_PALLOC_BUCKETS*2];
+     struct chunk_cache chunk_caches[PALLOC_CHUNK_CACHE_CLASSES];
+
+     //The first NUM_PALLOC_BUCKETS are chain heads; then come NUM_PALLOC_BUCKETS list heads for each of the PALLOC_PAGE_BINS bins
+     struct page_record* buckets[NUM_PALLOC_BUCKETS*(1 + PALLOC_PAGE_BINS)];
+     struct page_record* full_pages; /*pages with no free chunks (and so in no bin), linked through the chain pointers; must follow buckets*/
+
+     //Next superpage to carve off the current span, for the classes with superpages smaller than the span
+     uint8_t* span_cursors[PALLOC_HUGEPAGE_SPAN_CLASSES];
      
      plocklib_simple_t threadlock;
-     uint16_t pad16;
-     plocklib_simple_t pad8;
-     uint32_t pad32;
-     uint64_t pad64;
+     uint8_t pad8;
+     uint16_t trim_requested; /*set by malloc_trim() in another thread*/
+     plocklib_adaptive_t huge_lock; /*held to change the huge class stacks, and by other threads while they purge them (see purgelib.h)*/
+     struct page_record* remote_pages; /*pages other threads have remote freed into, linked through remote_queue_next*/
+
+     uint64_t huge_cached_bytes; /*mappings on our absurdly huge buckets*/
+     uint64_t profile_random; /*see profilelib.h*/
+     int in_profiler;
+
+     struct remote_free_batch remote_batches[PALLOC_REMOTE_BATCH_PAGES];
+
+     struct class_counters counters[NUM_PALLOC_BUCKETS];
+};
+
+/*An arena's pages have chains, bins and a full list just like a thread's, laid out the same way,
+  so the page code finds its way back from chain_head_ptr without knowing which it has.
+  Only the thread that created the arena may allocate from it or destroy it.*/
+struct palloc_arena
+{
+     struct page_record* buckets[NUM_PALLOC_BUCKETS*(1 + PALLOC_PAGE_BINS)];
+     struct page_record* full_pages;
+     uint8_t* span_cursors[PALLOC_HUGEPAGE_SPAN_CLASSES];
+     uint16_t owning_thread;
 };
+_Static_assert(offsetof(struct thread_record,full_pages)==offsetof(struct thread_record,buckets) + sizeof(struct page_record*)*NUM_PALLOC_BUCKETS*(1 + PALLOC_PAGE_BINS) &&
+               offsetof(struct palloc_arena,full_pages)==offsetof(struct palloc_arena,buckets) + sizeof(struct page_record*)*NUM_PALLOC_BUCKETS*(1 + PALLOC_PAGE_BINS),"see full_list_of");
 
 /*Also cachelicious.*/
 struct page_record
 {
     uint16_t prefilled_entries; /*high bit 1 indicates remote frees pending*/
-    uint16_t cached_predecessor_entries;
+    uint16_t bin_limit; /*free_entries past which we belong in an emptier bin; -1 for chain heads, which are in no bin*/
     uint16_t free_entries;
     uint16_t owning_thread; /*could in principle calculate from chain_head_ptr*/
 
     uint64_t bitmap[PALLOC_BITVEC_ENTRIES];
 
     struct page_record** chain_head_ptr;
-    struct page_record*  chain_back_ptr;
+    union
+    {
+         struct page_record* chain_back_ptr;
+         uint64_t cached_since; /*in a superpage or huge cache: when it went there, or 0 once purged*/
+    };
     struct page_record*  chain_forward_ptr;
 
-    uint64_t superpage_size; /*Size of the superpage for freeing.  DO NOT calculate based on the offset of chain_head_ptr from the first size class*/
+    uint32_t superpage_size; /*Size of the superpage for freeing.  DO NOT calculate based on the offset of chain_head_ptr from the first size class*/
+    uint8_t nonfull_words; /*bit i set when bitmap[i] has a free chunk*/
+    uint8_t bin; /*0 is the fullest*/
+    uint16_t pad16;
     uint64_t* remote_free_array; /*one cache line worth of data -- parallels bitmap*/
     int16_t pending_remote_frees;
-    uint16_t pad16;
-    uint32_t pad32;
-    uint64_t pad64;
+    uint16_t remote_queued; /*1 while we are on our owner's remote_pages list*/
+    uint16_t sampled_entries; /*live chunks the heap profiler is tracking*/
+    uint16_t untouched_from; /*chunks from here on have never been handed out (and are marked used in bitmap), so are still zero*/
+    struct page_record* remote_queue_next;
+};
+
+/*Superpages waiting for a new owner, one set of lists per size class:
+  completely free ones, and partially used ones left behind by threads that exited.
+  Free arena superpages are kept apart, for arenas only.
+  The lists are linked through chain_forward_ptr.
+  For the absurdly huge classes, empty_superpages holds the shared freed mappings.*/
+struct superpage_cache
+{
+     plocklib_adaptive_t lock;
+     uint16_t cached_superpages;
+     uint16_t cached_arena_superpages;
+     struct page_record* empty_superpages;
+     struct page_record* orphaned_superpages;
+     struct page_record* arena_superpages;
 };
 
-/*Huge static array that goes in the BSS.  This way, we don't need expensive initialization in the library constructor.*/
-static struct thread_record threads[PALLOC_MAX_THREADS];
+/*The thread records, PALLOC_THREAD_CHUNK at a time, mapped as threads show up (see threadindexlib.h).
+  The directory goes in the BSS.  This way, we don't need expensive initialization in the library constructor.*/
+static struct thread_record* thread_chunks[PALLOC_MAX_THREADS / PALLOC_THREAD_CHUNK];
 
-/*Per-thread index into the threads array*/
+static inline struct thread_record* thread_record_at(int index)
+{
+     return thread_chunks[index / PALLOC_THREAD_CHUNK] + index % PALLOC_THREAD_CHUNK;
+}
+
+/*Per-thread index into the thread records, and the record itself.
+  0 and NULL until the thread first needs one.*/
 static __thread uint16_t tls_index = 0;
+static __thread struct thread_record* tls_thread = NULL;
+
+/*Bytes this thread can allocate before the heap profiler takes a sample.  Next to tls_thread so malloc doesn't touch another line.*/
+static __thread int64_t tls_bytes_until_sample = 0;
+
+static struct superpage_cache superpage_caches[NUM_PALLOC_BUCKETS];
+
+/*Frees by threads without a thread record are counted here, with atomics.*/
+static struct class_counters unowned_counters[NUM_PALLOC_BUCKETS];
+
+/*remote_pages of a thread that has exited.  Nothing is queued on it until the record is reused.*/
+#define PALLOC_CLOSED_REMOTE_PAGES ((struct page_record*)(1))
+static void orphan_thread_heap();
+static void flush_remote_batches();
+static void flush_chunk_caches();
+static void process_remote_pages();
+static inline void start_thread_profile();
 
 #include "palloc2_memory_controls.h"
 #include "threadindexlib.h"
+#include "profilelib.h"
+#include "purgelib.h"
+
+/*palloc2_bounds.h works the layout out for itself.*/
+_Static_assert(PALLOC_BOUNDS_CLASS_SHIFT==PALLOC_CLASS_ADDRESS_SHIFT && PALLOC_BOUNDS_CLASSES==NUM_PALLOC_BUCKETS &&
+               PALLOC_BOUNDS_SUBCLASS_BITS==PALLOC_SUBCLASS_BITS && PALLOC_BOUNDS_REGION_LOW==C_AVOID_1 && PALLOC_BOUNDS_REGION_HIGH==C_AVOID_0 &&
+               PALLOC_BOUNDS_MIN_SUPERPAGE==MIN_SUPERPAGE_SIZE && MIN_SIZE_CLASS==8 && PALLOC_BOUNDS_MAX_SUPERPAGE_ORDER==PALLOC_HACK_MAX_SIZE_CLASS &&
+               PALLOC_BOUNDS_SINGLETON_ORDER==PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS && PALLOC_BOUNDS_SINGLETON_OFFSET==PALLOC_HACK_SINGLETON_MMAP_OFFSET &&
+               PALLOC_BOUNDS_RECIPROCALS==PALLOC_SUBCLASS_RECIPROCALS,"palloc2_bounds.h is out of date");
 
+/*Rounds orig_size up to its size class.
+  Returns 0 if the request is too big for any size class.*/
 static inline size_t align_size_class(size_t orig_size, int* size_class)
 {
 	if(!orig_size)
 		orig_size++;
 	int first_set_bit = fls64(orig_size);
+	/*Past the largest class, where rounding up would also wrap new_size to 0.*/
+	if(unlikely (first_set_bit > NUM_PALLOC_ORDERS - 1 + MIN_SET_BIT))
+		return 0;
 	size_t new_size = 1L << first_set_bit;
 
 	if(new_size!=orig_size)
@@ -85,7 +210,33 @@ static inline size_t align_size_class(size_t orig_size, int* size_class)
 		first_set_bit = MIN_SET_BIT;
 	}
 
-	*size_class = max(0,first_set_bit - MIN_SET_BIT);
+	int order = max(0,first_set_bit - MIN_SET_BIT);
+	if(unlikely (order >= NUM_PALLOC_ORDERS))
+		return 0;
+	*size_class = order << PALLOC_SUBCLASS_BITS;
+
+	/*See if one of the subclasses of the next order down is big enough.*/
+	if(new_size!=orig_size && PALLOC_ORDER_HAS_SUBCLASSES(order - 1))
+	{
+		size_t half_size = new_size >> 1;
+		int subclass_shift = first_set_bit - 1 - PALLOC_SUBCLASS_BITS;
+		size_t subclass = (orig_size - half_size + (1L << subclass_shift) - 1) >> subclass_shift;
+		if(subclass < PALLOC_SUBCLASSES)
+		{
+			*size_class = ((order - 1) << PALLOC_SUBCLASS_BITS) | subclass;
+			return half_size + (subclass << subclass_shift);
+		}
+	}
+
+	return new_size;
+}
+
+/*Like align_size_class, but for the smallest class whose chunks are all aligned to alignment (a power of two).*/
+static inline size_t align_size_class_aligned(size_t orig_size, size_t alignment, int* size_class)
+{
+	size_t new_size = align_size_class(max(orig_size,alignment),size_class);
+	while(new_size && palloc_class_alignment(*size_class) < alignment)
+		new_size = align_size_class(new_size + 1,size_class);
 	return new_size;
 }
 
@@ -101,6 +252,8 @@ static inline void process_remote_frees(struct page_record* bucket)
 	{
 		uint64_t ready_frees = plocklib_fetch_and_ffffffffffffffff(bucket->remote_free_array + i);
 		bucket->bitmap[i]&=ready_frees;
+		if(ready_frees!=(uint64_t)(-1))
+			bucket->nonfull_words |= 1 << i;
 		remote_frees_performed+=popcount(~ready_frees);
 	}
 
@@ -108,342 +261,1740 @@ static inline void process_remote_frees(struct page_record* bucket)
 	plocklib_atomic_add((uint16_t*)(&bucket->pending_remote_frees),-remote_frees_performed);
 }
 
-static inline void* heapspace(struct page_record** bucket, int size_class)
+/*Pages off the chain heads are kept on doubly linked lists through the chain pointers: the bins and the full list.*/
+static inline void page_list_push(struct page_record** list, struct page_record* record)
 {
-	dbgprintf("heapspace: size class %d\n",size_class);
-	if(unlikely (!*bucket))
-	{
-		dbgprintf("heapspace: no bucket\n");
-		*bucket = (struct page_record*)(mmap_address_class(size_class,min(size_class,PALLOC_HACK_MAX_SIZE_CLASS)));
-		int prefilled_entries = ALIGN_SIZE(sizeof(struct page_record),MIN_SIZE_CLASS << size_class)/(MIN_SIZE_CLASS << size_class);
-		int64_t first_bitmap_entry = (int64_t)(0x8000000000000000L) /*make sure this is computed on the fly*/ >> (prefilled_entries - 1);
-		(*bucket)->prefilled_entries = prefilled_entries;
-		(*bucket)->cached_predecessor_entries = (uint16_t)(-1);
-		(*bucket)->free_entries = PALLOC_PAGE_ENTRIES - prefilled_entries;
-		(*bucket)->owning_thread = tls_index;
-		(*bucket)->bitmap[0] = first_bitmap_entry;
-		(*bucket)->chain_head_ptr = bucket;
-		*(bucket + NUM_PALLOC_BUCKETS) = *bucket;
-		(*bucket)->superpage_size = MIN_SUPERPAGE_SIZE << min(size_class,PALLOC_HACK_MAX_SIZE_CLASS);
-
-		if(size_class > PALLOC_HACK_MAX_SIZE_CLASS)
-		{
-			int i = PALLOC_BITVEC_ENTRIES >> (size_class - PALLOC_HACK_MAX_SIZE_CLASS);
-			if(!i)
-                                abort();
-                        
-                        while(i < PALLOC_BITVEC_ENTRIES)
-			{
-				(*bucket)->prefilled_entries+=bits_in(uint64_t);
-				(*bucket)->bitmap[i] = (uint64_t)(-1);
-                                i++;
-			}
-		}
-	}
-	(*bucket)->free_entries--;
+     record->chain_back_ptr = NULL;
+     record->chain_forward_ptr = *list;
+     if(*list)
+          (*list)->chain_back_ptr = record;
+     *list = record;
+}
 
-	assert(!(*bucket)->chain_back_ptr);
-	dbgprintf("heapspace: bucket valid\n");
+static inline void page_list_remove(struct page_record** list, struct page_record* record)
+{
+     if(record->chain_back_ptr)
+          record->chain_back_ptr->chain_forward_ptr = record->chain_forward_ptr;
+     else
+          *list = record->chain_forward_ptr;
+     if(record->chain_forward_ptr)
+          record->chain_forward_ptr->chain_back_ptr = record->chain_back_ptr;
 
-	/*Update remote free buffer*/
-	if(unlikely (!(*bucket)->free_entries))
-		process_remote_frees(*bucket);
+     record->chain_back_ptr = NULL;
+     record->chain_forward_ptr = NULL;
+}
+
+static inline struct page_record** bin_list_of(struct page_record* record)
+{
+     return record->chain_head_ptr + NUM_PALLOC_BUCKETS*(1 + record->bin);
+}
+
+/*Bins split a page's capacity evenly by free chunks, fullest first.*/
+static inline int page_bin(struct page_record* record)
+{
+     return (record->free_entries - 1) * PALLOC_PAGE_BINS / (PALLOC_PAGE_ENTRIES - record->prefilled_entries);
+}
 
-	int i=0;
-	while((*bucket)->bitmap[i]==(uint64_t)(-1))
-		i++;
+/*Put a page with free chunks that is not a chain head in its bin.  bin_limit is the top of the bin's share.*/
+static inline void page_bin_insert(struct page_record* record)
+{
+     int capacity = PALLOC_PAGE_ENTRIES - record->prefilled_entries;
+     int bin = page_bin(record);
 
-	dbgprintf("heapspace: found partially free bitmap entry 0x%zx, index %d\n",(*bucket)->bitmap[i],i);
+     dbgprintf("page addition to bin %d\n",bin);
+     record->bin = bin;
+     record->bin_limit = ((bin + 1) * capacity + PALLOC_PAGE_BINS - 1) / PALLOC_PAGE_BINS;
+     page_list_push(bin_list_of(record),record);
+}
 
-	int bitpos = flz64((*bucket)->bitmap[i]);
-	dbgprintf("heapspace: found free bit offset %d\n",bitpos);
-	(*bucket)->bitmap[i] |= 1L << bitpos;
+/*Make the page at the front of the fullest bin the head of its chain, if there is one.*/
+static inline void promote_binned_page(struct page_record** bucket)
+{
+     int bin;
 
-	/*Save the base address of the superpage for the chunk to be returned by this allocation.*/
-	uint8_t* page_base = (uint8_t*)*bucket;
+     for(bin = 0; bin < PALLOC_PAGE_BINS; bin++)
+     {
+          struct page_record** list = bucket + NUM_PALLOC_BUCKETS*(1 + bin);
+          if(*list)
+          {
+               *bucket = *list;
+               page_list_remove(list,*bucket);
+               (*bucket)->bin_limit = (uint16_t)(-1);
+               return;
+          }
+     }
+}
 
-	dbgprintf("heapspace: chkpt 1\n");
+/*Keep a completely free superpage for reuse by any thread, or give it back to the OS
+  if we already have enough of them cached for its class.*/
+static void release_superpage(struct page_record* record, int size_class)
+{
+     struct superpage_cache* cache = superpage_caches + size_class;
 
-	/*If we've filled the head, make the next entry the head of the list*/
-	if(unlikely (!(*bucket)->free_entries))
-	{
-         dbgprintf("heapspace: filled page\n");
-         struct page_record* next_chain_ptr = (*bucket)->chain_forward_ptr;
-         (*bucket)->chain_back_ptr = NULL;
-         (*bucket)->cached_predecessor_entries = (uint16_t)(-1);
-         (*bucket)->chain_forward_ptr = NULL;
-         assert(!(*bucket)->chain_back_ptr);
-         *bucket = next_chain_ptr;
-         if(*bucket)
-         {
-              assert((*bucket)->chain_back_ptr);
-              (*bucket)->chain_back_ptr = NULL;
-              (*bucket)->cached_predecessor_entries = (uint16_t)(-1);
-         }
-         else
-              *(bucket + NUM_PALLOC_BUCKETS) = NULL;
-         dbgprintf("heapspace: handled free page\n");
-	}
+     dbgprintf("release_superpage: 0x%zx class %d\n",record,size_class);
+
+     /*Nobody can be freeing into an empty page, so its remote free buffer can go back to the pool.
+       The next remote free after the page is reused gets a fresh one.*/
+     if(record->remote_free_array)
+     {
+          release_rfree_buffer(record->remote_free_array);
+          record->remote_free_array = NULL;
+     }
+
+     int arena = ((size_t)(record) & PALLOC_ARENA_ADDRESS_BIT)!=0;
+     struct page_record** superpages = arena ? &cache->arena_superpages : &cache->empty_superpages;
+     uint16_t* cached_superpages = arena ? &cache->cached_arena_superpages : &cache->cached_superpages;
+
+     record->cached_since = purge_clock_ms();
+     plocklib_acquire_adaptive_lock(&cache->lock);
+     if(*cached_superpages < max(1,PALLOC_EMPTY_SUPERPAGE_CACHE_BYTES / record->superpage_size))
+     {
+          record->chain_forward_ptr = *superpages;
+          *superpages = record;
+          (*cached_superpages)++;
+          plocklib_release_adaptive_lock(&cache->lock);
+          return;
+     }
+     plocklib_release_adaptive_lock(&cache->lock);
 
-	return page_base + (i*bits_in(uint64_t) + (bits_in(uint64_t) - 1 - bitpos))*(MIN_SIZE_CLASS << size_class);
+     tls_thread->counters[size_class].bytes_mapped -= record->superpage_size;
+     munmap(record,record->superpage_size);
 }
 
-void* malloc(size_t size)
+static inline struct page_record* reuse_superpage(int size_class, int arena)
 {
-	dbgprintf("allocating: %zd from thread %d...\n",size,tls_index);
-    int size_class;
-    size = align_size_class(size,&size_class);
+     struct superpage_cache* cache = superpage_caches + size_class;
+     struct page_record** superpages = arena ? &cache->arena_superpages : &cache->empty_superpages;
+     struct page_record* record;
 
-    void* to_return;
-    if(unlikely (size_class >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS))
-    {
-         if(threads[tls_index].buckets[size_class])
-         {
-              to_return = threads[tls_index].buckets[size_class];
-              threads[tls_index].buckets[size_class] = ((struct page_record*)(to_return))->chain_forward_ptr;
-         }
-         else
-              to_return = mmap_address_class(size_class,size_class - PALLOC_HACK_SINGLETON_MMAP_OFFSET);
-    }
-    else
-    	to_return = heapspace(threads[tls_index].buckets + size_class, size_class);
-    dbgprintf("...0x%zx thread %d\n",to_return,tls_index);
-    return to_return;
+     if(!*superpages)
+          return NULL;
+
+     plocklib_acquire_adaptive_lock(&cache->lock);
+     record = *superpages;
+     if(record)
+     {
+          *superpages = record->chain_forward_ptr;
+          (*(arena ? &cache->cached_arena_superpages : &cache->cached_superpages))--;
+          record->chain_forward_ptr = NULL;
+          record->chain_back_ptr = NULL;
+     }
+     plocklib_release_adaptive_lock(&cache->lock);
+     return record;
 }
 
-static inline void local_free(void* address, struct page_record* record, int size_class, int bitmap_index, uint64_t free_mask)
+/*Frees of the absurdly huge classes.  The mapping has no page_record; the list link is written over the freed data.*/
+static uint64_t shared_huge_bytes;
+
+/*Offer a freed mapping to every thread, or unmap it if the shared cache is full.*/
+static void share_huge_mapping(struct page_record* mapping, int size_class)
 {
-	dbgprintf("local_free: 0x%zx\n",address);
-	record->bitmap[bitmap_index]&=free_mask;
-	uint16_t old_free_entries = record->free_entries;
-	record->free_entries++;
+     struct superpage_cache* cache = superpage_caches + size_class;
+     uint64_t size = palloc_superpage_size(size_class);
 
-#if 0
-	if(record->cached_predecessor_entries!=(uint16_t)(-1) && record->free_entries == PALLOC_PAGE_ENTRIES - record->prefilled_entries) /*we are totally free*/
-	{
-		dbgprintf("local_free: page deallocation\n");
-		/*We need to figure out whether to keep ourselves as a buffer*/
-		int keep = 1;
-		if(record->chain_forward_ptr) /*we have a successor, which may also be close to free*/
-			keep = 0;
-		else if(record->chain_back_ptr->free_entries >= PALLOC_PAGE_ENTRIES / 2)
-			keep = 0;
-		if(!keep) /*then free ourselves*/
-		{
-			record->chain_back_ptr->chain_forward_ptr = record->chain_forward_ptr;
-			if(record->chain_forward_ptr)
-				record->chain_forward_ptr->chain_back_ptr = record->chain_back_ptr;
-                        else
-                                *(record->chain_head_ptr + NUM_PALLOC_BUCKETS) = record->chain_back_ptr;
+     if(plocklib_fetch_and_add(&shared_huge_bytes,size) + size <= PALLOC_HUGE_CACHE_BYTES)
+     {
+          plocklib_acquire_adaptive_lock(&cache->lock);
+          mapping->chain_forward_ptr = cache->empty_superpages;
+          cache->empty_superpages = mapping;
+          cache->cached_superpages++;
+          plocklib_release_adaptive_lock(&cache->lock);
+          return;
+     }
+     plocklib_fetch_and_add(&shared_huge_bytes,-size);
 
-			munmap(record,record->superpage_size);
-		}
-	}
-	else
-#endif
-         if(unlikely (!old_free_entries)) /*we were previously full and need to insert ourselves as tail of our chain*/
-         {
-              dbgprintf("page addition to list\n");
-              if(*(record->chain_head_ptr + NUM_PALLOC_BUCKETS))
-              {
-                   record->chain_back_ptr = *(record->chain_head_ptr + NUM_PALLOC_BUCKETS);
-                   record->cached_predecessor_entries = record->chain_back_ptr->free_entries;
-                   (*(record->chain_head_ptr + NUM_PALLOC_BUCKETS))->chain_forward_ptr = record;
-                   *(record->chain_head_ptr + NUM_PALLOC_BUCKETS) = record;
-              }
-              else
-              {
-                   *(record->chain_head_ptr) = record;
-                   *(record->chain_head_ptr + NUM_PALLOC_BUCKETS) = record;
-                   record->cached_predecessor_entries = (uint16_t)(-1);
-              }
-         }
-         else if(unlikely (record->cached_predecessor_entries!=(uint16_t)(-1) && record->free_entries > record->cached_predecessor_entries)) /*we need to check if we should swap ourselves down the list -- use cached_predecessor_entries==-1 to enforce never swapping if we are head or next-to-head*/
-         {
-              dbgprintf("page list restructuring\n");
-              record->cached_predecessor_entries = record->chain_back_ptr==*(record->chain_head_ptr) ? (uint16_t)(-1) : record->chain_back_ptr->free_entries;
-              if(record->free_entries > record->cached_predecessor_entries)
-              {
-                   struct page_record* successor = record->chain_forward_ptr;
-                   struct page_record* predecessor = record->chain_back_ptr;
-                   record->chain_back_ptr = predecessor->chain_back_ptr;
-                   record->cached_predecessor_entries = record->chain_back_ptr==*(record->chain_head_ptr) ? (uint16_t)(-1) : record->chain_back_ptr->free_entries;
-                   record->chain_back_ptr->chain_forward_ptr = record;
-                   record->chain_forward_ptr = predecessor;
-                   predecessor->chain_back_ptr = record;
-                   predecessor->cached_predecessor_entries = record->free_entries;
-                   predecessor->chain_forward_ptr = successor;
-                   if(!successor)
-                        *(predecessor->chain_head_ptr + NUM_PALLOC_BUCKETS) = predecessor;
-                   else /*We are intentionally being conservative and NOT updating predecessor->cached_successor_free_entries in order to avoid a cache miss.*/
-                        successor->chain_back_ptr = predecessor;
-              }
-         }
-	dbgprintf("local_free end chkpt\n");
+     dbgprintf("share_huge_mapping: unmapping 0x%zx\n",mapping);
+     tls_thread->counters[size_class].bytes_mapped -= size;
+     munmap(mapping,size);
 }
 
-static inline void remote_free(void* address, struct page_record* record, int size_class, int bitmap_index, uint64_t free_mask)
+static inline void release_huge_mapping(struct page_record* mapping, int size_class)
 {
-#if 0
-	//See if we can steal it
-	uint16_t remote_owner = record->owning_thread;
-	if(remote_owner > PALLOC_MAX_THREADS && remote_owner - PALLOC_MAX_THREADS != tls_index)
-		if(plocklib_cas16(&record->owning_thread, remote_owner, tls_index))
-		{
-			int size_class;
-			align_size_class(record->superpage_size / PALLOC_PAGE_ENTRIES,&size_class);
-			record->chain_head_ptr = threads[tls_index].buckets + size_class;
-			local_free(address,record,size_class,bitmap_index,free_mask);
-			return;
-		}
-#endif
+     uint64_t size = palloc_superpage_size(size_class);
 
-	dbgprintf("remote_free tls_index: %d\n",tls_index);
-	if(!record->remote_free_array)
-	{
-		dbgprintf("remote_free: create array\n");
-		/*This is trickier than it might seem as we need to ensure we do not step on another thread's toes.*/
-		uint64_t* potential_free_array = get_rfree_buffer();
-		dbgprintf("remote_free: potential_free_array: 0x%zx\n",potential_free_array);
-		if(!plocklib_cas64((uint64_t*)(&record->remote_free_array),NULL,(uint64_t)(potential_free_array)))
-			release_rfree_buffer(potential_free_array);
-	}
+     mapping->cached_since = purge_clock_ms();
+     if(tls_thread->huge_cached_bytes + size <= PALLOC_HUGE_THREAD_CACHE_BYTES)
+     {
+          /*Stack rather than queue.*/
+          plocklib_acquire_adaptive_lock(&tls_thread->huge_lock);
+          mapping->chain_forward_ptr = tls_thread->buckets[size_class];
+          tls_thread->buckets[size_class] = mapping;
+          tls_thread->huge_cached_bytes += size;
+          plocklib_release_adaptive_lock(&tls_thread->huge_lock);
+          return;
+     }
+     share_huge_mapping(mapping,size_class);
+}
+
+static inline void* reuse_huge_mapping(int size_class)
+{
+     struct page_record* mapping = tls_thread->buckets[size_class];
 
-	dbgprintf("remote_free: chkpt 1\n");
+     if(mapping)
+     {
+          plocklib_acquire_adaptive_lock(&tls_thread->huge_lock);
+          mapping = tls_thread->buckets[size_class];
+          tls_thread->buckets[size_class] = mapping->chain_forward_ptr;
+          tls_thread->huge_cached_bytes -= palloc_superpage_size(size_class);
+          plocklib_release_adaptive_lock(&tls_thread->huge_lock);
+          return mapping;
+     }
 
-	/*Perform the actual free.*/
-	uint16_t prefilled_entries = record->prefilled_entries;
-	plocklib_atomic_and(record->remote_free_array + bitmap_index,free_mask);
-	plocklib_increment_and_fetch(&record->pending_remote_frees);
+     mapping = reuse_superpage(size_class,0);
+     if(mapping)
+          plocklib_fetch_and_add(&shared_huge_bytes,-palloc_superpage_size(size_class));
+     return mapping;
 }
 
-void free(void* address)
+/*Pages with no free chunks are kept on their owner's full_pages list rather than a chain,
+  so that they can be handed on when the owner exits.*/
+/*The full_pages of the thread or arena a page belongs to, which comes right after its buckets.*/
+static inline struct page_record** full_list_of(struct page_record* record)
 {
-	dbgprintf("free: 0x%zx thread %d\n",address,tls_index);
-	if(!address)
-		return;
-	int size_class = get_size_class_from_address((size_t)address);
-	if(unlikely (size_class >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS))
-	{
-         /*Stack rather than queue for these absurdly huge allocations.
-           The bucket tail pointers are unused, as are back pointers (singly linked list).*/
-         struct page_record* freed_huge_map = (struct page_record*)(address);
-         freed_huge_map->chain_forward_ptr = threads[tls_index].buckets[size_class];
-         threads[tls_index].buckets[size_class] = freed_huge_map;
-         return;
-	}
-	dbgprintf("free: size_class: %d\n",size_class);
-	struct page_record* address_page_record = (struct page_record*)((size_t)address & ~((MIN_SUPERPAGE_SIZE << size_class) - 1));
-	dbgprintf("free: address_page_record: 0x%zx\n",address_page_record);
-	size_t byte_offset = (size_t)address - (size_t)address_page_record;
-	dbgprintf("free: byte_offset: %zd\n",byte_offset);
-	int chunk_offset = byte_offset >> (MIN_SET_BIT + size_class);
-	dbgprintf("free: chunk_offset: %d\n",chunk_offset);
-	int bitmap_index = chunk_offset/bits_in(uint64_t);
-	dbgprintf("free: bitmap_index: %d\n",bitmap_index);
-	int bitmap_offset = chunk_offset%bits_in(uint64_t);
-	dbgprintf("free: bitmap_offset: %d\n",bitmap_offset);
-	uint64_t free_mask = 0x8000000000000000L; /*Make sure the compiler computes this on the fly.  It should if it's not retarded.*/
-	free_mask>>=bitmap_offset;
-	free_mask=~free_mask;
-	dbgprintf("free: free_mask: 0x%zx\n",free_mask);
+     return record->chain_head_ptr - get_size_class_from_address((size_t)(record)) + NUM_PALLOC_BUCKETS*(1 + PALLOC_PAGE_BINS);
+}
 
-	if(likely (address_page_record->owning_thread==tls_index))
-	    local_free(address,address_page_record,size_class,bitmap_index,free_mask);
-	else
-	    remote_free(address,address_page_record,size_class,bitmap_index,free_mask);
+static inline void full_list_push(struct page_record* record)
+{
+     page_list_push(full_list_of(record),record);
 }
 
-size_t malloc_usable_size(void* ptr)
+static inline void full_list_remove(struct page_record* record)
 {
-     int size_class = get_size_class_from_address((size_t)ptr);
-     return MIN_SIZE_CLASS << size_class;
+     page_list_remove(full_list_of(record),record);
 }
 
-void __attribute__ ((constructor)) palloc_initialize()
+/*A remote free sets its bit, queues the page, and only then bumps
+  pending_remote_frees.  So if every chunk is free, pending_remote_frees is 0
+  and we are not queued, no other thread can still be touching the page.*/
+static inline int page_is_empty(struct page_record* record)
 {
-     static int already_ran = 0;
-     dbgprintf("in palloc_initialize: %d\n",already_ran);
-     if(unlikely (!already_ran))
-     {
-#if 0
-          if(!real_mmap)
-               real_mmap = dlsym(((void*) -1l),"mmap");
-          if(!real_munmap)
-               real_munmap = dlsym(((void*) -1l),"munmap");
-#endif
-          plocklib_simple_init(&global_rfree_lock);
-          plocklib_simple_init(&id_lock);
-          plocklib_acquire_simple_lock(&threads[0].threadlock);
-          already_ran = 1;
-     }
+     return record->free_entries == PALLOC_PAGE_ENTRIES - record->prefilled_entries &&
+          !*(volatile int16_t*)(&record->pending_remote_frees) && !*(volatile uint16_t*)(&record->remote_queued);
 }
 
-void *realloc(void *ptr, size_t size)
+/*Leave a partially used page of an exiting thread for someone else to adopt.*/
+static inline void publish_orphan(struct page_record* record, int size_class)
 {
-	dbgprintf("realloc: 0x%zx %zd\n",ptr,size);
-	int size_class, old_size_class;
-	align_size_class(size,&size_class);
-    if(ptr==NULL)
-    	return malloc(size);
-    else if(size==0)
-    {
-    	free(ptr);
-    	return NULL;
-    }
-    else if((old_size_class = get_size_class_from_address((size_t)ptr)) >= size_class)
-    	return ptr;
-    else
-    {
-    	void* to_return = malloc(size);
-    	memcpy(to_return,ptr,MIN_SIZE_CLASS << old_size_class);
-    	free(ptr);
-    	return to_return;
-    }
+     struct superpage_cache* cache = superpage_caches + size_class;
+
+     dbgprintf("publish_orphan: 0x%zx class %d\n",record,size_class);
+     record->owning_thread = PALLOC_POOLED_OWNER;
+     plocklib_acquire_adaptive_lock(&cache->lock);
+     record->chain_forward_ptr = cache->orphaned_superpages;
+     cache->orphaned_superpages = record;
+     plocklib_release_adaptive_lock(&cache->lock);
 }
 
-void *calloc(size_t nelem, size_t elsize)
+/*Take a page out of the orphan pool and pick up the frees made into it while it was there.
+  Taking ownership with an atomic (and so a full barrier) before looking at remote_free_array
+  means a remote free that still saw PALLOC_POOLED_OWNER has already set its bit.*/
+static inline struct page_record* adopt_orphan(int size_class)
 {
-	dbgprintf("calloc: %zd %zd\n",nelem,elsize);
-    size_t size = nelem * elsize;
-    void* ptr = malloc(size);
-    if(ptr != NULL)
-    	memset(ptr,0,size);
-    return ptr;
+     struct superpage_cache* cache = superpage_caches + size_class;
+     struct page_record* record;
+
+     if(!cache->orphaned_superpages)
+          return NULL;
+
+     plocklib_acquire_adaptive_lock(&cache->lock);
+     record = cache->orphaned_superpages;
+     if(record)
+          cache->orphaned_superpages = record->chain_forward_ptr;
+     plocklib_release_adaptive_lock(&cache->lock);
+     if(!record)
+          return NULL;
+
+     dbgprintf("adopt_orphan: 0x%zx class %d\n",record,size_class);
+     record->chain_forward_ptr = NULL;
+     plocklib_cas16(&record->owning_thread,PALLOC_POOLED_OWNER,tls_index);
+     process_remote_frees(record);
+     return record;
 }
 
-void * memalign (size_t alignment, size_t size);
+/*Release a page in its owner's bins if it has become completely free.
+  The head stays put: it is the page we are allocating from.*/
+static inline void recycle_if_empty(struct page_record* record)
+{
+     if(record==*(record->chain_head_ptr) || !page_is_empty(record))
+          return;
 
-int posix_memalign (void **memptr, size_t alignment, size_t size)
+     dbgprintf("recycle_if_empty: page deallocation\n");
+     page_list_remove(bin_list_of(record),record);
+     release_superpage(record,get_size_class_from_address((size_t)record));
+}
+
+/*Take over a page that was full when its owner exited.  Only one thread wins the CAS.*/
+static inline int adopt_full_orphan(struct page_record* record, int size_class)
 {
-  dbgprintf("posix_memalign: 0x%zx %zd %zd\n",memptr,alignment,size);
-  // Check for non power-of-two alignment.
-  if ((alignment == 0) ||
-      (alignment & (alignment - 1)))
-    {
-      return EINVAL;
-    }
-  void * ptr = memalign (alignment, size);
-  if (!ptr) {
-    return ENOMEM;
-  } else {
-    *memptr = ptr;
-    return 0;
-  }
+     if(!plocklib_cas16(&record->owning_thread,PALLOC_ORPHANED_OWNER,tls_index))
+          return 0;
+
+     dbgprintf("adopt_full_orphan: 0x%zx class %d\n",record,size_class);
+     record->chain_head_ptr = tls_thread->buckets + size_class;
+     process_remote_frees(record);
+     if(record->free_entries)
+     {
+          page_bin_insert(record);
+          recycle_if_empty(record);
+     }
+     else
+          full_list_push(record);
+     return 1;
 }
 
-void * memalign (size_t alignment, size_t size)
+/*Moves a page of ours that has just had chunks freed to where it now belongs:
+  from the full list into a bin, into an emptier bin, or back to the superpage cache.*/
+static inline void page_entries_freed(struct page_record* record, uint16_t old_free_entries)
 {
-  dbgprintf("memalign: %zd %zd\n",alignment,size);
-  // NOTE: This function is deprecated.
-  if (alignment > size)
-    return malloc (alignment);
-  else
-    return malloc (size);
+	if(unlikely (!old_free_entries))
+	{
+		full_list_remove(record);
+		page_bin_insert(record);
+	}
+	else if(unlikely (record->free_entries > record->bin_limit))
+	{
+		page_list_remove(bin_list_of(record),record);
+		page_bin_insert(record);
+	}
+
+	if(unlikely (record->free_entries == PALLOC_PAGE_ENTRIES - record->prefilled_entries)) /*we are totally free*/
+		recycle_if_empty(record);
 }
 
-void* valloc(size_t size)
+/*Put a page on its owner's list of pages with remote frees to process.
+  Orphans have no owner to tell; whoever adopts them drains remote_free_array.*/
+static inline void queue_remote_page(struct page_record* record)
 {
-   dbgprintf("valloc: %zd\n",size);
-   return memalign(sysconf(_SC_PAGESIZE),size);
+     uint16_t owner_index = record->owning_thread;
+     if(owner_index >= PALLOC_MAX_THREADS || record->remote_queued || !plocklib_cas16(&record->remote_queued,0,1))
+          return;
+
+     struct thread_record* owner = thread_record_at(owner_index);
+     struct page_record* head;
+     do
+     {
+          head = owner->remote_pages;
+          if(unlikely (head==PALLOC_CLOSED_REMOTE_PAGES)) /*the owner exited after we looked, and the page is an orphan now*/
+          {
+               record->remote_queued = 0;
+               return;
+          }
+          record->remote_queue_next = head;
+     } while(!plocklib_cas64((uint64_t*)(&owner->remote_pages),(uint64_t)(head),(uint64_t)(record)));
+}
+
+/*Process the remote frees of every page other threads have queued on us.
+  Pages that were full go back in a bin; pages that are now empty are released.*/
+static void process_remote_pages()
+{
+     struct page_record* record = (struct page_record*)(plocklib_fetch_and_store64((uint64_t*)(&tls_thread->remote_pages),0));
+
+     while(record)
+     {
+          struct page_record* next = record->remote_queue_next;
+          uint16_t old_free_entries = record->free_entries;
+
+          dbgprintf("process_remote_pages: 0x%zx\n",record);
+          record->remote_queued = 0;
+          if(unlikely (record->owning_thread!=tls_index))
+          {
+               /*Queued on the previous user of our thread record, and orphaned when it exited.*/
+               if(record->owning_thread==PALLOC_ORPHANED_OWNER)
+                    adopt_full_orphan(record,get_size_class_from_address((size_t)record));
+               record = next;
+               continue;
+          }
+          process_remote_frees(record);
+          if(record->free_entries > old_free_entries)
+               page_entries_freed(record,old_free_entries);
+          record = next;
+     }
+}
+
+/*Called as the thread exits.  Hands every page we own to the threads that stay behind:
+  empty pages go to the superpage cache, partially used ones to the orphan pool,
+  and full ones are marked PALLOC_ORPHANED_OWNER for the next thread that frees into them.
+  Freed huge mappings go to the shared cache.  Span leftovers stay with the thread record for its next user.*/
+static void orphan_thread_heap()
+{
+     struct thread_record* thread = tls_thread;
+     struct page_record* record;
+     struct page_record* next;
+     int size_class, list;
+
+     flush_chunk_caches();
+     flush_remote_batches();
+     process_remote_pages();
+
+     /*The chain heads, then each bin.*/
+     for(size_class = 0; PALLOC_CLASS_ORDER(size_class) < PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS; size_class++)
+          for(list = 0; list <= PALLOC_PAGE_BINS; list++)
+          {
+               record = thread->buckets[size_class + NUM_PALLOC_BUCKETS*list];
+               thread->buckets[size_class + NUM_PALLOC_BUCKETS*list] = NULL;
+               for(; record; record = next)
+               {
+                    next = record->chain_forward_ptr;
+                    record->chain_back_ptr = NULL;
+                    record->chain_forward_ptr = NULL;
+                    if(page_is_empty(record))
+                         release_superpage(record,size_class);
+                    else
+                         publish_orphan(record,size_class);
+               }
+          }
+
+     plocklib_acquire_adaptive_lock(&thread->huge_lock);
+     for(size_class = PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS << PALLOC_SUBCLASS_BITS; size_class < NUM_PALLOC_BUCKETS; size_class += PALLOC_SUBCLASSES)
+     {
+          record = thread->buckets[size_class];
+          thread->buckets[size_class] = NULL;
+          for(; record; record = next)
+          {
+               next = record->chain_forward_ptr;
+               share_huge_mapping(record,size_class);
+          }
+     }
+     thread->huge_cached_bytes = 0;
+     plocklib_release_adaptive_lock(&thread->huge_lock);
+
+     /*Once a page is marked, another thread may take it at any time.*/
+     for(record = thread->full_pages; record; record = next)
+     {
+          next = record->chain_forward_ptr;
+          record->chain_back_ptr = NULL;
+          record->chain_forward_ptr = NULL;
+          plocklib_cas16(&record->owning_thread,tls_index,PALLOC_ORPHANED_OWNER);
+     }
+     thread->full_pages = NULL;
+
+     /*Pages queued since we drained are all orphans now; their adopters pick up the frees.*/
+     record = (struct page_record*)(plocklib_fetch_and_store64((uint64_t*)(&thread->remote_pages),(uint64_t)(PALLOC_CLOSED_REMOTE_PAGES)));
+     for(; record; record = next)
+     {
+          next = record->remote_queue_next;
+          record->remote_queued = 0;
+     }
+}
+
+/*Get a brand new superpage for a size class, for the thread or for an arena.*/
+static inline struct page_record* map_superpage(int size_class, struct palloc_arena* arena)
+{
+     struct class_counters* counters = tls_thread->counters + size_class;
+     int span_order = use_hugepages() ? PALLOC_HUGEPAGE_ORDER : PALLOC_SPAN_ORDER;
+     counters->superpages_mapped++;
+     if(size_class >= span_order << PALLOC_SUBCLASS_BITS)
+     {
+          counters->bytes_mapped += palloc_superpage_size(size_class);
+          return (struct page_record*)(mmap_address_class(size_class,min(PALLOC_CLASS_ORDER(size_class),PALLOC_HACK_MAX_SIZE_CLASS),arena!=NULL));
+     }
+
+     /*Spans are aligned to their size, so a cursor at a span boundary (or NULL) means we need a new one.*/
+     uint8_t** span_cursor = (arena ? arena->span_cursors : tls_thread->span_cursors) + size_class;
+     if(!((size_t)(*span_cursor) & ((MIN_SUPERPAGE_SIZE << span_order) - 1)))
+     {
+          counters->bytes_mapped += MIN_SUPERPAGE_SIZE << span_order;
+          *span_cursor = (uint8_t*)(mmap_address_class(size_class,span_order,arena!=NULL));
+     }
+
+     struct page_record* to_return = (struct page_record*)(*span_cursor);
+     *span_cursor += palloc_superpage_size(size_class);
+     return to_return;
+}
+
+/*Set up the page_record of a superpage that just became the head of its chain.*/
+static inline void init_superpage(struct page_record** bucket, int size_class, int fresh)
+{
+     (*bucket)->bin_limit = (uint16_t)(-1);
+     (*bucket)->owning_thread = tls_index;
+     (*bucket)->chain_head_ptr = bucket;
+
+     /*A recycled superpage already has its bitmap and counts in the empty state.*/
+     if(!fresh)
+          return;
+
+     size_t chunk_size = palloc_class_size(size_class);
+     uint64_t superpage_size = palloc_superpage_size(size_class);
+
+     /*The page_record eats the first few chunks.
+       Chunks that don't fit in the superpage (subclasses, and the huge orders
+       that share the PALLOC_HACK_MAX_SIZE_CLASS superpage size) are never handed out.
+       Everything starts out marked used: chunks are bumped off untouched_from until some are freed.*/
+     int header_entries = (sizeof(struct page_record) + chunk_size - 1) / chunk_size;
+     int usable_entries = min(PALLOC_PAGE_ENTRIES,superpage_size / chunk_size);
+     (*bucket)->prefilled_entries = header_entries + PALLOC_PAGE_ENTRIES - usable_entries;
+     (*bucket)->free_entries = PALLOC_PAGE_ENTRIES - (*bucket)->prefilled_entries;
+     memset((*bucket)->bitmap,-1,sizeof((*bucket)->bitmap));
+     (*bucket)->nonfull_words = 0;
+     (*bucket)->superpage_size = superpage_size;
+     (*bucket)->untouched_from = header_entries;
+
+     if(usable_entries <= header_entries)
+          abort();
+}
+
+/*Put a superpage with free chunks at the head of a chain, moving whatever was there into a bin.
+  Arenas only take arena superpages.*/
+static void new_chain_head(struct page_record** bucket, int size_class, struct palloc_arena* arena)
+{
+	struct page_record* old_head = *bucket;
+
+	if((!arena && (*bucket = adopt_orphan(size_class))) || (*bucket = reuse_superpage(size_class,arena!=NULL)))
+		init_superpage(bucket,size_class,0);
+	else
+	{
+		*bucket = map_superpage(size_class,arena);
+		init_superpage(bucket,size_class,1);
+	}
+
+	if(old_head)
+		page_bin_insert(old_head);
+}
+
+/*The head of a chain has no free chunks left: move it to the full list and make the fullest binned page the head.*/
+static inline void pop_full_head(struct page_record** bucket)
+{
+	dbgprintf("heapspace: filled page\n");
+	full_list_push(*bucket);
+	*bucket = NULL;
+
+	if(tls_thread->remote_pages)
+		process_remote_pages();
+	promote_binned_page(bucket);
+	dbgprintf("heapspace: handled free page\n");
+
+	purge_if_due();
+}
+
+/*Sets *fresh if the chunk has never been handed out before, and so is still zero.*/
+static inline void* heapspace(struct page_record** bucket, int size_class, int* fresh, struct palloc_arena* arena)
+{
+	dbgprintf("heapspace: size class %d\n",size_class);
+	if(unlikely (!*bucket))
+	{
+		dbgprintf("heapspace: no bucket\n");
+		/*Pages that other threads freed into may give us one back.*/
+		if(tls_thread->remote_pages)
+			process_remote_pages();
+		promote_binned_page(bucket);
+	}
+	if(unlikely (!*bucket))
+		new_chain_head(bucket,size_class,arena);
+	(*bucket)->free_entries--;
+
+	assert(!(*bucket)->chain_back_ptr);
+	dbgprintf("heapspace: bucket valid\n");
+
+	/*Update remote free buffer*/
+	if(unlikely (!(*bucket)->free_entries))
+		process_remote_frees(*bucket);
+
+	/*Save the base address of the superpage for the chunk to be returned by this allocation.*/
+	uint8_t* page_base = (uint8_t*)*bucket;
+	int chunk_index;
+
+	/*Reuse the lowest freed chunk if there is one.  Otherwise every free chunk is past
+	  untouched_from (free_entries counts both), so take the next one of those.*/
+	if((*bucket)->nonfull_words)
+	{
+		int i = __builtin_ctz((*bucket)->nonfull_words);
+		dbgprintf("heapspace: found partially free bitmap entry 0x%zx, index %d\n",(*bucket)->bitmap[i],i);
+
+		int bitpos = flz64((*bucket)->bitmap[i]);
+		dbgprintf("heapspace: found free bit offset %d\n",bitpos);
+		(*bucket)->bitmap[i] |= 1L << bitpos;
+		if((*bucket)->bitmap[i]==(uint64_t)(-1))
+			(*bucket)->nonfull_words &= ~(1 << i);
+		chunk_index = i*bits_in(uint64_t) + (bits_in(uint64_t) - 1 - bitpos);
+		*fresh = 0;
+	}
+	else
+	{
+		chunk_index = (*bucket)->untouched_from++;
+		*fresh = 1;
+	}
+
+	dbgprintf("heapspace: chkpt 1\n");
+
+	/*If we've filled the head, make the next entry the head of the list*/
+	if(unlikely (!(*bucket)->free_entries))
+		pop_full_head(bucket);
+
+	return page_base + chunk_index*palloc_class_size(size_class);
+}
+
+/*heapspace() n times over, taking every free chunk it needs from a bitmap word in one go
+  and a run of untouched chunks with one bump.*/
+static void heapspace_batch(struct page_record** bucket, int size_class, size_t n, void** out)
+{
+	size_t chunk_size = palloc_class_size(size_class);
+
+	while(n)
+	{
+		if(unlikely (!*bucket))
+		{
+			if(tls_thread->remote_pages)
+				process_remote_pages();
+			promote_binned_page(bucket);
+		}
+		if(unlikely (!*bucket))
+			new_chain_head(bucket,size_class,NULL);
+
+		struct page_record* record = *bucket;
+		uint8_t* page_base = (uint8_t*)(record);
+		int take = min(n,record->free_entries);
+		record->free_entries -= take;
+		n -= take;
+
+		while(take && record->nonfull_words)
+		{
+			int i = __builtin_ctz(record->nonfull_words);
+			uint64_t free_bits = ~record->bitmap[i];
+			for(; free_bits && take; take--)
+			{
+				int bitpos = fls64(free_bits);
+				free_bits &= ~(1L << bitpos);
+				*out++ = page_base + (i*bits_in(uint64_t) + (bits_in(uint64_t) - 1 - bitpos))*chunk_size;
+			}
+			record->bitmap[i] = ~free_bits;
+			if(!free_bits)
+				record->nonfull_words &= ~(1 << i);
+		}
+		for(; take; take--)
+			*out++ = page_base + record->untouched_from++ * chunk_size;
+
+		if(unlikely (!record->free_entries))
+			process_remote_frees(record);
+		if(unlikely (!record->free_entries))
+			pop_full_head(bucket);
+	}
+}
+
+/*Clear the bitmap bits of chunks from to to-1.*/
+static void mark_chunks_free(struct page_record* record, int from, int to)
+{
+	while(from < to)
+	{
+		int word = from / bits_in(uint64_t);
+		int offset = from % bits_in(uint64_t);
+		int count = min(bits_in(uint64_t) - offset,to - from);
+		uint64_t mask = count==bits_in(uint64_t) ? (uint64_t)(-1) : ((1UL << count) - 1) << (bits_in(uint64_t) - offset - count);
+		record->bitmap[word] &= ~mask;
+		record->nonfull_words |= 1 << word;
+		from += count;
+	}
+}
+
+/*The page to look at after record (NULL for the first) when searching a chain: the head, then the bins fullest first.*/
+static inline struct page_record* next_chain_page(struct page_record** bucket, struct page_record* record)
+{
+	int bin = 0;
+
+	if(!record && *bucket)
+		return *bucket;
+	if(record && record->chain_forward_ptr)
+		return record->chain_forward_ptr;
+	if(record && record!=*bucket)
+		bin = record->bin + 1;
+	for(; bin < PALLOC_PAGE_BINS; bin++)
+		if(*(bucket + NUM_PALLOC_BUCKETS*(1 + bin)))
+			return *(bucket + NUM_PALLOC_BUCKETS*(1 + bin));
+	return NULL;
+}
+
+/*A chunk of size_class aligned to alignment, which must be more than palloc_class_alignment(size_class)
+  but at most PALLOC_ALIGNED_MAX_STRIDE times it.  Superpages are aligned to their size, so every
+  stride-th chunk is aligned.  If the chunk comes from past untouched_from, the ones skipped to get
+  there go into the bitmap as free.*/
+static void* __attribute__ ((noinline)) heapspace_aligned(int size_class, size_t alignment, int* fresh)
+{
+	struct page_record** bucket = tls_thread->buckets + size_class;
+	size_t chunk_size = palloc_class_size(size_class);
+	int usable_entries = min(PALLOC_PAGE_ENTRIES,palloc_superpage_size(size_class) / chunk_size);
+	int stride = alignment / palloc_class_alignment(size_class);
+	uint64_t candidates_mask = 0;
+	struct page_record* record;
+	int chunk_index, i, pages;
+
+	for(i = 0; i < bits_in(uint64_t); i += stride)
+		candidates_mask |= 0x8000000000000000UL >> i;
+
+	if(unlikely (!*bucket) && tls_thread->remote_pages)
+		process_remote_pages();
+	for(;;)
+	{
+		for(record = next_chain_page(bucket,NULL), pages = 0; record && pages < PALLOC_ALIGNED_SEARCH_PAGES; record = next_chain_page(bucket,record), pages++)
+		{
+			uint64_t words;
+			for(words = record->nonfull_words; words; words &= words - 1)
+			{
+				i = __builtin_ctz(words);
+				uint64_t candidates = ~record->bitmap[i] & candidates_mask;
+				if(candidates)
+				{
+					int bitpos = fls64(candidates);
+					record->bitmap[i] |= 1L << bitpos;
+					if(record->bitmap[i]==(uint64_t)(-1))
+						record->nonfull_words &= ~(1 << i);
+					chunk_index = i*bits_in(uint64_t) + (bits_in(uint64_t) - 1 - bitpos);
+					*fresh = 0;
+					goto found;
+				}
+			}
+
+			chunk_index = (record->untouched_from + stride - 1) & ~(stride - 1);
+			if(chunk_index < usable_entries)
+			{
+				mark_chunks_free(record,record->untouched_from,chunk_index);
+				record->untouched_from = chunk_index + 1;
+				*fresh = 1;
+				goto found;
+			}
+		}
+		new_chain_head(bucket,size_class,NULL);
+	}
+
+found:
+	record->free_entries--;
+	if(unlikely (!record->free_entries))
+		process_remote_frees(record);
+	if(unlikely (!record->free_entries))
+	{
+		if(record==*bucket)
+			pop_full_head(bucket);
+		else
+		{
+			page_list_remove(bin_list_of(record),record);
+			full_list_push(record);
+		}
+	}
+	else if(record!=*bucket && page_bin(record)!=record->bin)
+	{
+		page_list_remove(bin_list_of(record),record);
+		page_bin_insert(record);
+	}
+	return (uint8_t*)(record) + chunk_index*chunk_size;
+}
+
+/*malloc, and whether the memory is known to be zero (see calloc).*/
+static inline void* allocate(size_t size, int* fresh)
+{
+	dbgprintf("allocating: %zd from thread %d...\n",size,tls_index);
+    if(unlikely (!tls_thread))
+         register_thread();
+
+    int size_class;
+    size = align_size_class(size,&size_class);
+    if(unlikely (!size))
+    {
+         errno = ENOMEM;
+         return NULL;
+    }
+
+    void* to_return;
+    if(unlikely (PALLOC_CLASS_ORDER(size_class) >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS))
+    {
+         purge_if_due();
+         *fresh = 0;
+         if(!(to_return = reuse_huge_mapping(size_class)))
+         {
+              *fresh = 1;
+              tls_thread->counters[size_class].superpages_mapped++;
+              tls_thread->counters[size_class].bytes_mapped += palloc_superpage_size(size_class);
+              to_return = mmap_address_class(size_class,PALLOC_CLASS_ORDER(size_class) - PALLOC_HACK_SINGLETON_MMAP_OFFSET,0);
+         }
+    }
+    else if(likely (size_class < PALLOC_CHUNK_CACHE_CLASSES) && tls_thread->chunk_caches[size_class].head)
+    {
+         struct chunk_cache* cache = tls_thread->chunk_caches + size_class;
+         *fresh = 0;
+         to_return = cache->head;
+         cache->head = *(void**)(to_return);
+         cache->entries--;
+    }
+    else
+    	to_return = heapspace(tls_thread->buckets + size_class, size_class, fresh, NULL);
+    tls_thread->counters[size_class].allocations++;
+    if(unlikely ((tls_bytes_until_sample -= size) < 0))
+         sample_allocation(to_return,size,PALLOC_CLASS_ORDER(size_class) >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS ? NULL : (struct page_record*)((size_t)to_return & ~(palloc_superpage_size(size_class) - 1)));
+    dbgprintf("...0x%zx thread %d\n",to_return,tls_index);
+    return to_return;
+}
+
+/*allocate() for a chunk aligned to alignment (a power of two).
+  Uses the smallest class that is aligned enough itself, or that has aligned chunks often enough to carve one out.*/
+static void* allocate_aligned(size_t size, size_t alignment)
+{
+    int size_class = 0, fresh; /*align_size_class leaves it alone when it fails, and gcc can't see we stop then*/
+    size_t class_size = align_size_class(size,&size_class);
+
+    while(class_size && palloc_class_alignment(size_class) * PALLOC_ALIGNED_MAX_STRIDE < alignment)
+         class_size = align_size_class(class_size + 1,&size_class);
+    if(unlikely (!class_size))
+    {
+         errno = ENOMEM;
+         return NULL;
+    }
+    if(palloc_class_alignment(size_class) >= alignment)
+         return allocate(class_size,&fresh);
+    if(PALLOC_CLASS_ORDER(size_class) >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS)
+    {
+         class_size = align_size_class_aligned(size,alignment,&size_class);
+         if(unlikely (!class_size))
+         {
+              errno = ENOMEM;
+              return NULL;
+         }
+         return allocate(class_size,&fresh);
+    }
+
+    if(unlikely (!tls_thread))
+         register_thread();
+    void* to_return = heapspace_aligned(size_class,alignment,&fresh);
+    tls_thread->counters[size_class].allocations++;
+    if(unlikely ((tls_bytes_until_sample -= class_size) < 0))
+         sample_allocation(to_return,class_size,(struct page_record*)((size_t)to_return & ~(palloc_superpage_size(size_class) - 1)));
+    dbgprintf("allocate_aligned: 0x%zx thread %d\n",to_return,tls_index);
+    return to_return;
+}
+
+void* malloc(size_t size)
+{
+    int fresh;
+    return allocate(size,&fresh);
+}
+
+static inline void local_free(void* address, struct page_record* record, int size_class, int bitmap_index, uint64_t free_mask)
+{
+	dbgprintf("local_free: 0x%zx\n",address);
+	record->bitmap[bitmap_index]&=free_mask;
+	record->nonfull_words |= 1 << bitmap_index;
+	uint16_t old_free_entries = record->free_entries;
+	record->free_entries++;
+	page_entries_freed(record,old_free_entries);
+	dbgprintf("local_free end chkpt\n");
+}
+
+/*Apply remote frees of the chunks set in freed to a page we don't own.
+  The bits are set, the page is queued, and only then is pending_remote_frees bumped (see page_is_empty).*/
+static inline void remote_free_chunks(struct page_record* record, uint64_t* freed)
+{
+	dbgprintf("remote_free_chunks: 0x%zx tls_index: %d\n",record,tls_index);
+	if(!record->remote_free_array)
+	{
+		dbgprintf("remote_free: create array\n");
+		/*This is trickier than it might seem as we need to ensure we do not step on another thread's toes.*/
+		uint64_t* potential_free_array = get_rfree_buffer();
+		dbgprintf("remote_free: potential_free_array: 0x%zx\n",potential_free_array);
+		if(!plocklib_cas64((uint64_t*)(&record->remote_free_array),0,(uint64_t)(potential_free_array)))
+			release_rfree_buffer(potential_free_array);
+	}
+
+	int freed_chunks = 0;
+	int i;
+	for(i=0; i<PALLOC_BITVEC_ENTRIES; i++)
+		if(freed[i])
+		{
+			plocklib_atomic_and(record->remote_free_array + i,~freed[i]);
+			freed_chunks+=popcount(freed[i]);
+			freed[i] = 0;
+		}
+	queue_remote_page(record);
+	plocklib_atomic_add((uint16_t*)(&record->pending_remote_frees),freed_chunks);
+}
+
+static inline void flush_remote_batch(struct remote_free_batch* batch)
+{
+	remote_free_chunks(batch->record,batch->freed);
+	batch->record = NULL;
+	batch->frees = 0;
+}
+
+static void flush_remote_batches()
+{
+	struct remote_free_batch* batch;
+	for(batch = tls_thread->remote_batches; batch < tls_thread->remote_batches + PALLOC_REMOTE_BATCH_PAGES; batch++)
+		if(batch->record)
+			flush_remote_batch(batch);
+}
+
+static inline void remote_free(void* address, struct page_record* record, int size_class, int bitmap_index, uint64_t free_mask)
+{
+	/*Threads without a record (exiting, or never allocated) free right away.
+	  So do frees into arena pages, which can't be left in a batch that outlives the arena.*/
+	if(unlikely (!tls_thread || ((size_t)(record) & PALLOC_ARENA_ADDRESS_BIT)))
+	{
+		if(tls_thread)
+			tls_thread->counters[size_class].remote_frees++;
+		else
+			plocklib_fetch_and_add(&unowned_counters[size_class].remote_frees,1);
+		uint64_t freed[PALLOC_BITVEC_ENTRIES] = {0};
+		freed[bitmap_index] = ~free_mask;
+		remote_free_chunks(record,freed);
+
+		/*We can't adopt a page that was full when its owner exited, and if only threads like us
+		  free into it nobody else will either.  Pool it for the next thread that allocates.*/
+		if(unlikely (record->owning_thread==PALLOC_ORPHANED_OWNER) && plocklib_cas16(&record->owning_thread,PALLOC_ORPHANED_OWNER,PALLOC_POOLED_OWNER))
+			publish_orphan(record,size_class);
+		return;
+	}
+
+	tls_thread->counters[size_class].remote_frees++;
+
+	//See if we can steal it
+	if(unlikely (record->owning_thread==PALLOC_ORPHANED_OWNER) && adopt_full_orphan(record,size_class))
+	{
+		local_free(address,record,size_class,bitmap_index,free_mask);
+		return;
+	}
+
+	/*Superpages are at least MIN_SUPERPAGE_SIZE aligned, and each size class has its own region.*/
+	size_t page_hash = (size_t)record / MIN_SUPERPAGE_SIZE ^ ((size_t)record >> PALLOC_CLASS_ADDRESS_SHIFT);
+	struct remote_free_batch* batch = tls_thread->remote_batches + page_hash % PALLOC_REMOTE_BATCH_PAGES;
+	if(unlikely (batch->record!=record))
+	{
+		if(batch->record)
+			flush_remote_batch(batch);
+		batch->record = record;
+	}
+	batch->freed[bitmap_index] |= ~free_mask;
+
+	if(unlikely (++batch->frees >= PALLOC_REMOTE_BATCH_FREES))
+		flush_remote_batch(batch);
+}
+
+/*Returns a chunk to its page.  The caller counts the free.*/
+static inline void free_chunk(void* address, int size_class)
+{
+	struct page_record* address_page_record = (struct page_record*)((size_t)address & ~(palloc_superpage_size(size_class) - 1));
+	dbgprintf("free: address_page_record: 0x%zx\n",address_page_record);
+	size_t byte_offset = (size_t)address - (size_t)address_page_record;
+	dbgprintf("free: byte_offset: %zd\n",byte_offset);
+	int chunk_offset = palloc_chunk_index(byte_offset,size_class);
+	dbgprintf("free: chunk_offset: %d\n",chunk_offset);
+	int bitmap_index = chunk_offset/bits_in(uint64_t);
+	dbgprintf("free: bitmap_index: %d\n",bitmap_index);
+	int bitmap_offset = chunk_offset%bits_in(uint64_t);
+	dbgprintf("free: bitmap_offset: %d\n",bitmap_offset);
+	uint64_t free_mask = 0x8000000000000000L; /*Make sure the compiler computes this on the fly.  It should if it's not retarded.*/
+	free_mask>>=bitmap_offset;
+	free_mask=~free_mask;
+	dbgprintf("free: free_mask: 0x%zx\n",free_mask);
+
+	if(likely (address_page_record->owning_thread==tls_index))
+	    local_free(address,address_page_record,size_class,bitmap_index,free_mask);
+	else
+	    remote_free(address,address_page_record,size_class,bitmap_index,free_mask);
+}
+
+/*Frees the older half of a full chunk cache.*/
+static void __attribute__ ((noinline)) flush_chunk_cache(struct chunk_cache* cache, int size_class)
+{
+	void** last_kept = (void**)(cache->head);
+	void* chunk;
+	int i;
+
+	for(i = 1; i < PALLOC_CHUNK_CACHE_ENTRIES/2; i++)
+		last_kept = (void**)(*last_kept);
+	chunk = *last_kept;
+	*last_kept = NULL;
+	cache->entries = PALLOC_CHUNK_CACHE_ENTRIES/2;
+	while(chunk)
+	{
+		void* next = *(void**)(chunk);
+		free_chunk(chunk,size_class);
+		chunk = next;
+	}
+}
+
+/*Called when a thread goes away.*/
+static void flush_chunk_caches()
+{
+	int size_class;
+
+	for(size_class = 0; size_class < PALLOC_CHUNK_CACHE_CLASSES; size_class++)
+	{
+		struct chunk_cache* cache = tls_thread->chunk_caches + size_class;
+		void* chunk = cache->head;
+		cache->head = NULL;
+		cache->entries = 0;
+		while(chunk)
+		{
+			void* next = *(void**)(chunk);
+			free_chunk(chunk,size_class);
+			chunk = next;
+		}
+	}
+}
+
+static inline void deallocate(void* address)
+{
+	dbgprintf("free: 0x%zx thread %d\n",address,tls_index);
+	if(!address)
+		return;
+	int size_class = get_size_class_from_address((size_t)address);
+	if(unlikely (PALLOC_CLASS_ORDER(size_class) >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS))
+	{
+         if(unlikely (!tls_thread))
+              register_thread();
+         if(unlikely (*(volatile uint64_t*)(&profile_live_samples)))
+              retire_sample(address,NULL);
+         tls_thread->counters[size_class].frees++;
+         release_huge_mapping((struct page_record*)(address),size_class);
+         return;
+	}
+	dbgprintf("free: size_class: %d\n",size_class);
+
+	if(unlikely (profile_rate))
+	{
+	    struct page_record* address_page_record = (struct page_record*)((size_t)address & ~(palloc_superpage_size(size_class) - 1));
+	    if(address_page_record->sampled_entries)
+	         retire_sample(address,address_page_record);
+	}
+
+	if(unlikely (!tls_thread))
+	{
+	    plocklib_fetch_and_add(&unowned_counters[size_class].frees,1);
+	    free_chunk(address,size_class);
+	    return;
+	}
+	tls_thread->counters[size_class].frees++;
+
+	/*Chunks go on the cache whichever thread owns their page; the page finds out when the cache is flushed.
+	  Arena chunks don't, since their page can go away at any time.*/
+	if(likely (size_class < PALLOC_CHUNK_CACHE_CLASSES && !((size_t)(address) & PALLOC_ARENA_ADDRESS_BIT)))
+	{
+	    struct chunk_cache* cache = tls_thread->chunk_caches + size_class;
+	    if(unlikely (cache->entries==PALLOC_CHUNK_CACHE_ENTRIES))
+	         flush_chunk_cache(cache,size_class);
+	    *(void**)(address) = cache->head;
+	    cache->head = address;
+	    cache->entries++;
+	    return;
+	}
+	free_chunk(address,size_class);
+}
+
+void free(void* address)
+{
+	deallocate(address);
+}
+
+size_t malloc_usable_size(void* ptr)
+{
+     if(!ptr)
+          return 0;
+     int size_class = get_size_class_from_address((size_t)ptr);
+     return palloc_class_size(size_class);
+}
+
+/*Purges every cache now, and the free pages inside our own superpages (see purgelib.h).
+  Other threads purge theirs at their next check.  There is no heap top to keep, so pad is ignored.*/
+int malloc_trim(size_t pad)
+{
+     int allocated = *(volatile int*)(&allocated_threads);
+     size_t purged = 0;
+     int index;
+
+     if(tls_thread)
+          purged += trim_thread_heap();
+     purged += purge_caches(UINT64_MAX);
+     for(index = 1; index < allocated; index++)
+          if(index!=tls_index && *(volatile plocklib_simple_t*)(&thread_record_at(index)->threadlock))
+               thread_record_at(index)->trim_requested = 1;
+     return purged > 0;
+}
+
+static int print_stats_at_exit;
+
+void __attribute__ ((constructor)) palloc_initialize()
+{
+     static int already_ran = 0;
+     dbgprintf("in palloc_initialize: %d\n",already_ran);
+     if(unlikely (!already_ran))
+     {
+          plocklib_adaptive_init(&id_lock);
+          print_stats_at_exit = getenv("PALLOC_STATS")!=NULL;
+          profile_initialize();
+          purge_initialize();
+          already_ran = 1;
+     }
+}
+
+void __attribute__ ((destructor)) palloc_finalize()
+{
+     if(print_stats_at_exit)
+          malloc_stats();
+     if(profile_rate)
+          palloc_dump_profile(profile_path);
+}
+
+/*Move ptr's chunk into a new chunk of size_class with mremap.
+  Only for the absurdly huge classes: each chunk is a whole mapping, so the new one is replaced
+  outright and the old one goes away.  Moving part of a superpage would split its mapping,
+  and a realloc-heavy program would keep adding mappings until it hit vm.max_map_count.*/
+static void* realloc_by_moving_pages(void* ptr, int old_size_class, size_t size, int size_class)
+{
+	size_t old_size = palloc_class_size(old_size_class);
+	void* to_return = malloc(size);
+	if(!to_return)
+		return NULL;
+
+	dbgprintf("realloc_by_moving_pages: 0x%zx to 0x%zx\n",ptr,to_return);
+	if(mremap(ptr,old_size,palloc_class_size(size_class),MREMAP_MAYMOVE|MREMAP_FIXED,to_return)==MAP_FAILED)
+	{
+		memcpy(to_return,ptr,min(old_size,size));
+		free(ptr);
+		return to_return;
+	}
+
+	/*The whole mapping has moved, so there is nothing left to free.*/
+	if(unlikely (*(volatile uint64_t*)(&profile_live_samples)))
+		retire_sample(ptr,NULL);
+	tls_thread->counters[old_size_class].frees++;
+	tls_thread->counters[old_size_class].bytes_mapped -= old_size;
+	return to_return;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	dbgprintf("realloc: 0x%zx %zd\n",ptr,size);
+	int size_class, old_size_class;
+	if(!align_size_class(size,&size_class))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+    if(ptr==NULL)
+    	return malloc(size);
+    else if(size==0)
+    {
+    	free(ptr);
+    	return NULL;
+    }
+
+    /*Shrinking by less than two classes isn't worth moving for.*/
+    old_size_class = get_size_class_from_address((size_t)ptr);
+    if(old_size_class==size_class || (old_size_class > size_class && palloc_smaller_class(old_size_class) <= size_class))
+    	return ptr;
+
+    /*The size class is part of the address, so a chunk can't grow in place;
+      huge ones get their pages moved to the new chunk instead of copied.*/
+    if(min(PALLOC_CLASS_ORDER(old_size_class),PALLOC_CLASS_ORDER(size_class)) >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS)
+    	return realloc_by_moving_pages(ptr,old_size_class,size,size_class);
+
+    void* to_return = malloc(size);
+    if(to_return)
+    {
+    	memcpy(to_return,ptr,min(palloc_class_size(old_size_class),size));
+    	free(ptr);
+    }
+    return to_return;
+}
+
+void *calloc(size_t nelem, size_t elsize)
+{
+	dbgprintf("calloc: %zd %zd\n",nelem,elsize);
+    size_t size;
+    int fresh;
+    if(__builtin_mul_overflow(nelem,elsize,&size))
+    {
+    	errno = ENOMEM;
+    	return NULL;
+    }
+
+    /*Memory straight from the kernel is already zero; don't fault it in just to clear it.*/
+    void* ptr = allocate(size,&fresh);
+    if(ptr != NULL && !fresh)
+    	memset(ptr,0,size);
+    return ptr;
+}
+
+void * memalign (size_t alignment, size_t size);
+
+int posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+  dbgprintf("posix_memalign: 0x%zx %zd %zd\n",memptr,alignment,size);
+  // Check for non power-of-two alignment.
+  if ((alignment == 0) ||
+      (alignment & (alignment - 1)))
+    {
+      return EINVAL;
+    }
+  void * ptr = memalign (alignment, size);
+  if (!ptr) {
+    return ENOMEM;
+  } else {
+    *memptr = ptr;
+    return 0;
+  }
+}
+
+void * memalign (size_t alignment, size_t size)
+{
+  dbgprintf("memalign: %zd %zd\n",alignment,size);
+  // NOTE: This function is deprecated.
+  // Like glibc, round odd alignments up to a power of two.
+  if (alignment & (alignment - 1))
+    alignment = 1L << (fls64 (alignment) + 1);
+  return allocate_aligned (size, alignment);
+}
+
+void * aligned_alloc (size_t alignment, size_t size)
+{
+  dbgprintf("aligned_alloc: %zd %zd\n",alignment,size);
+  if ((alignment == 0) ||
+      (alignment & (alignment - 1)))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  return allocate_aligned (size, alignment);
+}
+
+void* valloc(size_t size)
+{
+   dbgprintf("valloc: %zd\n",size);
+   return memalign(sysconf(_SC_PAGESIZE),size);
+}
+
+void* pvalloc(size_t size)
+{
+   dbgprintf("pvalloc: %zd\n",size);
+   size_t page_size = sysconf(_SC_PAGESIZE);
+   if(size > SIZE_MAX - page_size)
+   {
+        errno = ENOMEM;
+        return NULL;
+   }
+   return memalign(page_size,max((size + page_size - 1) & ~(page_size - 1),page_size));
+}
+
+struct palloc_arena* palloc_arena_create()
+{
+     int fresh;
+     struct palloc_arena* arena = (struct palloc_arena*)(allocate(sizeof(struct palloc_arena),&fresh));
+     if(!arena)
+          return NULL;
+     memset(arena,0,sizeof(struct palloc_arena));
+     arena->owning_thread = tls_index;
+     return arena;
+}
+
+void* palloc_arena_malloc(struct palloc_arena* arena, size_t size)
+{
+     int size_class, fresh;
+     void* to_return;
+
+     assert(arena->owning_thread==tls_index);
+     size = align_size_class(size,&size_class);
+     if(unlikely (!size))
+     {
+          errno = ENOMEM;
+          return NULL;
+     }
+     if(unlikely (PALLOC_CLASS_ORDER(size_class) >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS))
+          return allocate(size,&fresh);
+
+     to_return = heapspace(arena->buckets + size_class,size_class,&fresh,arena);
+     tls_thread->counters[size_class].allocations++;
+     if(unlikely ((tls_bytes_until_sample -= size) < 0))
+          sample_allocation(to_return,size,(struct page_record*)((size_t)to_return & ~(palloc_superpage_size(size_class) - 1)));
+     return to_return;
+}
+
+/*Free everything still allocated on an arena page at once and put the page back in the empty state:
+  chunks handed out are free in the bitmap, and the ones past untouched_from are still untouched.*/
+static void release_arena_page(struct page_record* record, int size_class)
+{
+     size_t chunk_size = palloc_class_size(size_class);
+     int usable_entries = min(PALLOC_PAGE_ENTRIES,record->superpage_size / chunk_size);
+     int header_entries = record->prefilled_entries - (PALLOC_PAGE_ENTRIES - usable_entries);
+     int i;
+
+     if(unlikely (record->sampled_entries))
+          for(i = header_entries; i < record->untouched_from && record->sampled_entries; i++)
+               if(record->bitmap[i / bits_in(uint64_t)] & (0x8000000000000000UL >> (i % bits_in(uint64_t))))
+                    retire_sample((uint8_t*)(record) + i*chunk_size,record);
+     record->sampled_entries = 0;
+
+     tls_thread->counters[size_class].frees += PALLOC_PAGE_ENTRIES - record->prefilled_entries - record->free_entries;
+     memset(record->bitmap,-1,sizeof(record->bitmap));
+     record->nonfull_words = 0;
+     mark_chunks_free(record,header_entries,record->untouched_from);
+     record->free_entries = PALLOC_PAGE_ENTRIES - record->prefilled_entries;
+     record->chain_back_ptr = NULL;
+     record->chain_forward_ptr = NULL;
+     release_superpage(record,size_class);
+}
+
+void palloc_arena_destroy(struct palloc_arena* arena)
+{
+     struct page_record* record;
+     struct page_record* next;
+     int size_class, list;
+
+     if(!arena)
+          return;
+     assert(arena->owning_thread==tls_index);
+
+     /*Frees other threads made into our pages must land before the pages go.*/
+     process_remote_pages();
+
+     /*The chain heads, then each bin.*/
+     for(size_class = 0; PALLOC_CLASS_ORDER(size_class) < PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS; size_class++)
+          for(list = 0; list <= PALLOC_PAGE_BINS; list++)
+               for(record = arena->buckets[size_class + NUM_PALLOC_BUCKETS*list]; record; record = next)
+               {
+                    next = record->chain_forward_ptr;
+                    release_arena_page(record,size_class);
+               }
+     for(record = arena->full_pages; record; record = next)
+     {
+          next = record->chain_forward_ptr;
+          release_arena_page(record,get_size_class_from_address((size_t)(record)));
+     }
+
+     /*What is left of the spans has never been used.*/
+     for(size_class = 0; size_class < PALLOC_HUGEPAGE_SPAN_CLASSES; size_class++)
+     {
+          size_t span_size = MIN_SUPERPAGE_SIZE << (use_hugepages() ? PALLOC_HUGEPAGE_ORDER : PALLOC_SPAN_ORDER);
+          size_t left = (span_size - ((size_t)(arena->span_cursors[size_class]) & (span_size - 1))) & (span_size - 1);
+          if(arena->span_cursors[size_class] && left)
+          {
+               tls_thread->counters[size_class].bytes_mapped -= left;
+               munmap(arena->span_cursors[size_class],left);
+          }
+     }
+
+     deallocate(arena);
+}
+
+size_t palloc_malloc_batch(size_t size, size_t n, void** out)
+{
+     int size_class, fresh;
+     size_t i = 0;
+
+     if(unlikely (!tls_thread))
+          register_thread();
+     size = align_size_class(size,&size_class);
+     if(unlikely (!size))
+     {
+          errno = ENOMEM;
+          return 0;
+     }
+     if(unlikely (PALLOC_CLASS_ORDER(size_class) >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS))
+     {
+          for(; i < n; i++)
+               if(unlikely (!(out[i] = allocate(size,&fresh))))
+               {
+                    /*All or nothing, as for the smaller classes.*/
+                    while(i)
+                         free(out[--i]);
+                    errno = ENOMEM;
+                    return 0;
+               }
+          return n;
+     }
+
+     if(size_class < PALLOC_CHUNK_CACHE_CLASSES)
+     {
+          struct chunk_cache* cache = tls_thread->chunk_caches + size_class;
+          for(; i < n && cache->head; i++)
+          {
+               out[i] = cache->head;
+               cache->head = *(void**)(out[i]);
+               cache->entries--;
+          }
+     }
+     heapspace_batch(tls_thread->buckets + size_class,size_class,n - i,out + i);
+
+     tls_thread->counters[size_class].allocations += n;
+     for(i = 0; i < n; i++)
+          if(unlikely ((tls_bytes_until_sample -= size) < 0))
+               sample_allocation(out[i],size,(struct page_record*)((size_t)(out[i]) & ~(palloc_superpage_size(size_class) - 1)));
+     return n;
+}
+
+/*Frees count chunks of one page, marked in freed, and clears freed.*/
+static void free_batch_run(struct page_record* record, int size_class, uint64_t* freed, int count)
+{
+     int i;
+
+     tls_thread->counters[size_class].frees += count;
+     if(record->owning_thread!=tls_index)
+     {
+          tls_thread->counters[size_class].remote_frees += count;
+          if(record->owning_thread!=PALLOC_ORPHANED_OWNER || !adopt_full_orphan(record,size_class))
+          {
+               remote_free_chunks(record,freed);
+               return;
+          }
+     }
+
+     for(i = 0; i < PALLOC_BITVEC_ENTRIES; i++)
+          if(freed[i])
+          {
+               record->bitmap[i] &= ~freed[i];
+               record->nonfull_words |= 1 << i;
+               freed[i] = 0;
+          }
+     uint16_t old_free_entries = record->free_entries;
+     record->free_entries += count;
+     page_entries_freed(record,old_free_entries);
+}
+
+void palloc_free_batch(void** ptrs, size_t n)
+{
+     uint64_t freed[PALLOC_BITVEC_ENTRIES] = {0};
+     struct page_record* run = NULL;
+     int run_class = 0, run_count = 0;
+     size_t i;
+
+     if(unlikely (!tls_thread))
+     {
+          for(i = 0; i < n; i++)
+               deallocate(ptrs[i]);
+          return;
+     }
+
+     for(i = 0; i < n; i++)
+     {
+          void* address = ptrs[i];
+          if(!address)
+               continue;
+          int size_class = get_size_class_from_address((size_t)(address));
+          if(unlikely (PALLOC_CLASS_ORDER(size_class) >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS))
+          {
+               deallocate(address);
+               continue;
+          }
+
+          struct page_record* record = (struct page_record*)((size_t)(address) & ~(palloc_superpage_size(size_class) - 1));
+          if(unlikely (profile_rate) && record->sampled_entries)
+               retire_sample(address,record);
+          if(record!=run)
+          {
+               if(run)
+                    free_batch_run(run,run_class,freed,run_count);
+               run = record;
+               run_class = size_class;
+               run_count = 0;
+          }
+          int chunk_index = palloc_chunk_index((size_t)(address) - (size_t)(record),size_class);
+          freed[chunk_index / bits_in(uint64_t)] |= 0x8000000000000000UL >> (chunk_index % bits_in(uint64_t));
+          run_count++;
+     }
+     if(run)
+          free_batch_run(run,run_class,freed,run_count);
+}
+
+/*The replaceable C++ operator new and delete, so C++ code gets here without going through libstdc++ and malloc.
+  They are defined under their Itanium ABI names (size_t is unsigned long), since this is a C file.
+  Failing allocations run the new handler and throw std::bad_alloc with libstdc++'s own functions,
+  which are always there when something calls operator new.
+  The size class is in the address, so sized delete has nothing to use the size for.*/
+typedef void (*new_handler_t)();
+extern new_handler_t get_new_handler() __asm__("_ZSt15get_new_handlerv") __attribute__ ((weak));
+extern void throw_bad_alloc() __asm__("_ZSt17__throw_bad_allocv") __attribute__ ((weak, noreturn));
+
+static void* __attribute__ ((noinline)) cxx_new_failed(size_t size, size_t alignment)
+{
+     void* to_return = NULL;
+     int fresh;
+
+     while(!to_return)
+     {
+          new_handler_t handler = get_new_handler ? get_new_handler() : NULL;
+          if(!handler)
+          {
+               if(throw_bad_alloc)
+                    throw_bad_alloc();
+               abort();
+          }
+          handler();
+          to_return = alignment ? allocate_aligned(size,alignment) : allocate(size,&fresh);
+     }
+     return to_return;
+}
+
+static inline void* cxx_new(size_t size)
+{
+     int fresh;
+     void* to_return = allocate(size,&fresh);
+     if(unlikely (!to_return))
+          return cxx_new_failed(size,0);
+     return to_return;
+}
+
+static inline void* cxx_new_aligned(size_t size, size_t alignment)
+{
+     void* to_return = allocate_aligned(size,alignment);
+     if(unlikely (!to_return))
+          return cxx_new_failed(size,alignment);
+     return to_return;
+}
+
+/*nothrow new has to run the new handler too, and return NULL instead of letting bad_alloc out.
+  C can't catch it, so with a handler installed we hand the retry to libstdc++'s own nothrow new
+  (symbol is its name), which calls our throwing operator new above inside a try block.*/
+static void* __attribute__ ((noinline)) cxx_new_nothrow_failed(const char* symbol, size_t size, size_t alignment, const void* nothrow)
+{
+     void* next;
+
+     if(!get_new_handler || !get_new_handler() || !(next = dlsym(RTLD_NEXT,symbol)))
+          return NULL;
+     if(alignment)
+          return ((void* (*)(size_t, size_t, const void*))(next))(size,alignment,nothrow);
+     return ((void* (*)(size_t, const void*))(next))(size,nothrow);
+}
+
+static inline void* cxx_new_nothrow(const char* symbol, size_t size, const void* nothrow)
+{
+     int fresh;
+     void* to_return = allocate(size,&fresh);
+     if(unlikely (!to_return))
+          return cxx_new_nothrow_failed(symbol,size,0,nothrow);
+     return to_return;
+}
+
+static inline void* cxx_new_aligned_nothrow(const char* symbol, size_t size, size_t alignment, const void* nothrow)
+{
+     void* to_return = allocate_aligned(size,alignment);
+     if(unlikely (!to_return))
+          return cxx_new_nothrow_failed(symbol,size,alignment,nothrow);
+     return to_return;
+}
+
+void* cxx_new_1(size_t size) __asm__("_Znwm");
+void* cxx_new_1(size_t size) { return cxx_new(size); }
+void* cxx_new_2(size_t size) __asm__("_Znam");
+void* cxx_new_2(size_t size) { return cxx_new(size); }
+void* cxx_new_3(size_t size, const void* nothrow) __asm__("_ZnwmRKSt9nothrow_t");
+void* cxx_new_3(size_t size, const void* nothrow) { return cxx_new_nothrow("_ZnwmRKSt9nothrow_t",size,nothrow); }
+void* cxx_new_4(size_t size, const void* nothrow) __asm__("_ZnamRKSt9nothrow_t");
+void* cxx_new_4(size_t size, const void* nothrow) { return cxx_new_nothrow("_ZnamRKSt9nothrow_t",size,nothrow); }
+void* cxx_new_5(size_t size, size_t alignment) __asm__("_ZnwmSt11align_val_t");
+void* cxx_new_5(size_t size, size_t alignment) { return cxx_new_aligned(size,alignment); }
+void* cxx_new_6(size_t size, size_t alignment) __asm__("_ZnamSt11align_val_t");
+void* cxx_new_6(size_t size, size_t alignment) { return cxx_new_aligned(size,alignment); }
+void* cxx_new_7(size_t size, size_t alignment, const void* nothrow) __asm__("_ZnwmSt11align_val_tRKSt9nothrow_t");
+void* cxx_new_7(size_t size, size_t alignment, const void* nothrow) { return cxx_new_aligned_nothrow("_ZnwmSt11align_val_tRKSt9nothrow_t",size,alignment,nothrow); }
+void* cxx_new_8(size_t size, size_t alignment, const void* nothrow) __asm__("_ZnamSt11align_val_tRKSt9nothrow_t");
+void* cxx_new_8(size_t size, size_t alignment, const void* nothrow) { return cxx_new_aligned_nothrow("_ZnamSt11align_val_tRKSt9nothrow_t",size,alignment,nothrow); }
+
+void cxx_delete_1(void* address) __asm__("_ZdlPv");
+void cxx_delete_1(void* address) { deallocate(address); }
+void cxx_delete_2(void* address) __asm__("_ZdaPv");
+void cxx_delete_2(void* address) { deallocate(address); }
+void cxx_delete_3(void* address, const void* nothrow) __asm__("_ZdlPvRKSt9nothrow_t");
+void cxx_delete_3(void* address, const void* nothrow) { deallocate(address); }
+void cxx_delete_4(void* address, const void* nothrow) __asm__("_ZdaPvRKSt9nothrow_t");
+void cxx_delete_4(void* address, const void* nothrow) { deallocate(address); }
+void cxx_delete_5(void* address, size_t size) __asm__("_ZdlPvm");
+void cxx_delete_5(void* address, size_t size) { deallocate(address); }
+void cxx_delete_6(void* address, size_t size) __asm__("_ZdaPvm");
+void cxx_delete_6(void* address, size_t size) { deallocate(address); }
+void cxx_delete_7(void* address, size_t alignment) __asm__("_ZdlPvSt11align_val_t");
+void cxx_delete_7(void* address, size_t alignment) { deallocate(address); }
+void cxx_delete_8(void* address, size_t alignment) __asm__("_ZdaPvSt11align_val_t");
+void cxx_delete_8(void* address, size_t alignment) { deallocate(address); }
+void cxx_delete_9(void* address, size_t alignment, const void* nothrow) __asm__("_ZdlPvSt11align_val_tRKSt9nothrow_t");
+void cxx_delete_9(void* address, size_t alignment, const void* nothrow) { deallocate(address); }
+void cxx_delete_10(void* address, size_t alignment, const void* nothrow) __asm__("_ZdaPvSt11align_val_tRKSt9nothrow_t");
+void cxx_delete_10(void* address, size_t alignment, const void* nothrow) { deallocate(address); }
+void cxx_delete_11(void* address, size_t size, size_t alignment) __asm__("_ZdlPvmSt11align_val_t");
+void cxx_delete_11(void* address, size_t size, size_t alignment) { deallocate(address); }
+void cxx_delete_12(void* address, size_t size, size_t alignment) __asm__("_ZdaPvmSt11align_val_t");
+void cxx_delete_12(void* address, size_t size, size_t alignment) { deallocate(address); }
+
+/*Sum every thread record's counters, live threads or not.
+  Records are never unmapped and only grow, so this needs no locks; the result is a snapshot at best.*/
+static void sum_class_counters(struct class_counters* totals)
+{
+     int allocated = *(volatile int*)(&allocated_threads);
+     int index, size_class;
+
+     memcpy(totals,unowned_counters,sizeof(unowned_counters));
+     for(index = 1; index < allocated; index++)
+     {
+          struct class_counters* counters = thread_record_at(index)->counters;
+          for(size_class = 0; size_class < NUM_PALLOC_BUCKETS; size_class++)
+          {
+               totals[size_class].allocations += counters[size_class].allocations;
+               totals[size_class].frees += counters[size_class].frees;
+               totals[size_class].remote_frees += counters[size_class].remote_frees;
+               totals[size_class].superpages_mapped += counters[size_class].superpages_mapped;
+               totals[size_class].bytes_mapped += counters[size_class].bytes_mapped;
+          }
+     }
+}
+
+static void fill_class_stats(struct palloc_class_stats* stats, struct class_counters* counters, int size_class)
+{
+     stats->size_class = size_class;
+     stats->chunk_size = palloc_class_size(size_class);
+     stats->allocations = counters->allocations;
+     stats->frees = counters->frees;
+     stats->remote_frees = counters->remote_frees;
+     stats->superpages_mapped = counters->superpages_mapped;
+     /*Counters are read racily, so don't let a free counted before its malloc go negative.*/
+     stats->bytes_live = counters->allocations > counters->frees ? (counters->allocations - counters->frees) * stats->chunk_size : 0;
+     stats->bytes_mapped = max(counters->bytes_mapped,0);
+}
+
+size_t palloc_get_class_stats(struct palloc_class_stats* stats, size_t max_classes)
+{
+     struct class_counters totals[NUM_PALLOC_BUCKETS];
+     size_t used_classes = 0;
+     int size_class;
+
+     sum_class_counters(totals);
+     for(size_class = 0; size_class < NUM_PALLOC_BUCKETS; size_class++)
+     {
+          if(!totals[size_class].allocations && !totals[size_class].frees && !totals[size_class].bytes_mapped)
+               continue;
+          if(used_classes < max_classes)
+               fill_class_stats(stats + used_classes,totals + size_class,size_class);
+          used_classes++;
+     }
+     return used_classes;
+}
+
+/*Whether a line of /proc/self/smaps starts one of our mappings.*/
+static int smaps_mapping_is_ours(const char* line)
+{
+     char* end;
+     size_t start = strtoul(line,&end,16);
+     if(end==line || *end!='-')
+          return -1; /*not a mapping line*/
+     int size_class = get_size_class_from_address(start);
+     return size_class < NUM_PALLOC_BUCKETS && (start & ~((1L << PALLOC_CLASS_ADDRESS_SHIFT) - 1))==class_region_start(size_class);
+}
+
+/*Reads smaps with read() rather than stdio, which could allocate.*/
+size_t palloc_get_hugepage_bytes()
+{
+     char buffer[4096];
+     size_t length = 0, total = 0;
+     ssize_t got;
+     int ours = 0;
+     int fd = open("/proc/self/smaps",O_RDONLY);
+
+     if(fd < 0)
+          return 0;
+     while((got = read(fd,buffer + length,sizeof(buffer) - 1 - length)) > 0)
+     {
+          char* line = buffer;
+          char* end;
+
+          length += got;
+          buffer[length] = '\0';
+          for(; (end = strchr(line,'\n')); line = end + 1)
+          {
+               *end = '\0';
+               if(!strncmp(line,"AnonHugePages:",14))
+               {
+                    if(ours)
+                         total += strtoul(line + 14,NULL,10) << 10;
+               }
+               else
+               {
+                    int mapping = smaps_mapping_is_ours(line);
+                    if(mapping >= 0)
+                         ours = mapping;
+               }
+          }
+          length = buffer + length - line;
+          if(length==sizeof(buffer) - 1) /*no line is this long; skip it*/
+               length = 0;
+          memmove(buffer,line,length);
+     }
+     close(fd);
+     return total;
+}
+
+/*arena and uordblks cover the superpages; hblks and hblkhd the singleton mappings of the absurdly huge classes.*/
+struct mallinfo2 mallinfo2()
+{
+     struct palloc_class_stats stats[NUM_PALLOC_BUCKETS];
+     struct mallinfo2 info;
+     size_t used_classes = palloc_get_class_stats(stats,NUM_PALLOC_BUCKETS);
+     size_t i;
+
+     memset(&info,0,sizeof(info));
+     for(i = 0; i < used_classes; i++)
+     {
+          if(PALLOC_CLASS_ORDER(stats[i].size_class) >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS)
+          {
+               info.hblks += stats[i].superpages_mapped;
+               info.hblkhd += stats[i].bytes_mapped;
+          }
+          else
+               info.arena += stats[i].bytes_mapped;
+          info.uordblks += stats[i].bytes_live;
+          info.ordblks += superpage_caches[stats[i].size_class].cached_superpages;
+     }
+     info.usmblks = info.arena + info.hblkhd;
+     info.fordblks = info.usmblks > info.uordblks ? info.usmblks - info.uordblks : 0;
+     return info;
+}
+
+void malloc_stats()
+{
+     struct palloc_class_stats stats[NUM_PALLOC_BUCKETS];
+     size_t used_classes = palloc_get_class_stats(stats,NUM_PALLOC_BUCKETS);
+     size_t total_live = 0, total_mapped = 0;
+     size_t i;
+
+     fprintf(stderr,"%10s %14s %14s %14s %10s %14s %14s\n","chunk","allocations","frees","remote frees","superpages","live bytes","mapped bytes");
+     for(i = 0; i < used_classes; i++)
+     {
+          fprintf(stderr,"%10zu %14lu %14lu %14lu %10lu %14zu %14zu\n",stats[i].chunk_size,stats[i].allocations,stats[i].frees,
+                  stats[i].remote_frees,stats[i].superpages_mapped,stats[i].bytes_live,stats[i].bytes_mapped);
+          total_live += stats[i].bytes_live;
+          total_mapped += stats[i].bytes_mapped;
+     }
+     fprintf(stderr,"Total:\nsystem bytes     = %14zu\nin use bytes     = %14zu\n",total_mapped,total_live);
+     if(use_hugepages())
+          fprintf(stderr,"huge page bytes  = %14zu\n",palloc_get_hugepage_bytes());
+#ifdef PLOCKLIB_CONTENTION_STATS
+     uint64_t contended = id_lock.contended + profile_lock.contended, sleeps = id_lock.sleeps + profile_lock.sleeps;
+     for(i = 0; i < NUM_PALLOC_BUCKETS; i++)
+     {
+          contended += superpage_caches[i].lock.contended;
+          sleeps += superpage_caches[i].lock.sleeps;
+     }
+     fprintf(stderr,"lock waits       = %14lu\nlock sleeps      = %14lu\n",contended,sleeps);
+#endif
+}
+
+int malloc_info(int options, FILE* fp)
+{
+     struct palloc_class_stats stats[NUM_PALLOC_BUCKETS];
+     size_t used_classes;
+     size_t total_live = 0, total_mapped = 0;
+     size_t i;
+
+     if(options)
+     {
+          errno = EINVAL;
+          return -1;
+     }
+
+     used_classes = palloc_get_class_stats(stats,NUM_PALLOC_BUCKETS);
+     fprintf(fp,"<malloc version=\"palloc2\">\n<classes>\n");
+     for(i = 0; i < used_classes; i++)
+     {
+          fprintf(fp,"  <class size=\"%zu\" allocations=\"%lu\" frees=\"%lu\" remote_frees=\"%lu\" superpages=\"%lu\" live=\"%zu\" mapped=\"%zu\"/>\n",
+                  stats[i].chunk_size,stats[i].allocations,stats[i].frees,stats[i].remote_frees,stats[i].superpages_mapped,stats[i].bytes_live,stats[i].bytes_mapped);
+          total_live += stats[i].bytes_live;
+          total_mapped += stats[i].bytes_mapped;
+     }
+     fprintf(fp,"</classes>\n<system type=\"current\" size=\"%zu\"/>\n<total type=\"live\" size=\"%zu\"/>\n",total_mapped,total_live);
+     if(use_hugepages())
+          fprintf(fp,"<total type=\"hugepage\" size=\"%zu\"/>\n",palloc_get_hugepage_bytes());
+     fprintf(fp,"</malloc>\n");
+     return 0;
 }
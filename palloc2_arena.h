@@ -0,0 +1,23 @@
+#ifndef PALLOC2_ARENA_H
+#define PALLOC2_ARENA_H
+
+/*Arenas: allocate many objects, then free them all at once.
+
+  An arena has superpages of its own, and palloc_arena_destroy() gives them all
+  back in one go without visiting the objects one by one.  Objects can still
+  be passed to free() (or realloc()) individually before that, from any thread.
+  An arena belongs to the thread that created it: only that thread may
+  allocate from it or destroy it, and it must destroy it before exiting.
+  Allocations too big for a superpage (16MB and up) come from the ordinary
+  heap and are not freed by palloc_arena_destroy().*/
+
+#include <stddef.h>
+
+struct palloc_arena;
+
+/*Returns NULL with errno set if there is no memory for the arena.*/
+struct palloc_arena* palloc_arena_create(void);
+void* palloc_arena_malloc(struct palloc_arena* arena, size_t size);
+void palloc_arena_destroy(struct palloc_arena* arena);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef PALLOC2_BATCH_H
+#define PALLOC2_BATCH_H
+
+/*Many objects of one size at once.
+
+  palloc_malloc_batch() fills its slots a bitmap word at a time, and
+  palloc_free_batch() updates each superpage once for a run of pointers into
+  it rather than once per object.  Runs are consecutive pointers on the same
+  superpage, so free in about the order you allocated to get the most from it.
+  Objects from either can also be passed to free() and realloc() as usual.*/
+
+#include <stddef.h>
+
+/*Stores n objects of size bytes in out.  Returns n, or 0 with errno set and
+  nothing allocated if size is too big or there is no memory for all n.*/
+size_t palloc_malloc_batch(size_t size, size_t n, void** out);
+
+/*free() for each of the n pointers in ptrs; NULL entries are skipped.*/
+void palloc_free_batch(void** ptrs, size_t n);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef PALLOC2_BOUNDS_H
+#define PALLOC2_BOUNDS_H
+
+/*Object bounds from a pointer, for baggy bounds checking.
+
+  Each size class lives in its own region of the address space, and its chunks
+  sit at fixed offsets in superpages aligned to their own size.  So the chunk
+  holding an address, interior pointers included, follows from the address
+  alone: these read no memory and take no locks.  The bounds are the whole
+  chunk's, which can be a little more than was asked for.  The answers mean
+  nothing for pointers palloc_owns() rejects.*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*Copies of the layout in palloc_config.h and palloc2_memory_controls.h; palloc.c checks they agree.*/
+#define PALLOC_BOUNDS_CLASS_SHIFT 39
+#define PALLOC_BOUNDS_CLASSES 121
+#define PALLOC_BOUNDS_SUBCLASS_BITS 2
+#define PALLOC_BOUNDS_REGION_MASK (3UL << 46)
+#define PALLOC_BOUNDS_REGION_LOW 0x0000400000000000UL /*orders up to 15*/
+#define PALLOC_BOUNDS_REGION_HIGH 0x0000200000000000UL
+#define PALLOC_BOUNDS_MIN_SUPERPAGE 4096UL
+#define PALLOC_BOUNDS_MAX_SUPERPAGE_ORDER 18
+#define PALLOC_BOUNDS_SINGLETON_ORDER 21
+#define PALLOC_BOUNDS_SINGLETON_OFFSET 9
+#define PALLOC_BOUNDS_RECIPROCALS 0x24932AAB33344000UL
+
+static inline int palloc_size_class(const void* ptr)
+{
+     return ((uintptr_t)(ptr) & ~PALLOC_BOUNDS_REGION_MASK) >> PALLOC_BOUNDS_CLASS_SHIFT;
+}
+
+/*Whether ptr is in the address range palloc2 hands memory out from.
+  Mappings palloc2 didn't make (a PIE executable, say) can sit in that range
+  too, so a false answer is certain and a true one is only likely.*/
+static inline int palloc_owns(const void* ptr)
+{
+     uintptr_t size_class = palloc_size_class(ptr);
+     uintptr_t region = ((size_class >> PALLOC_BOUNDS_SUBCLASS_BITS) > 15 ? PALLOC_BOUNDS_REGION_HIGH : PALLOC_BOUNDS_REGION_LOW) | (size_class << PALLOC_BOUNDS_CLASS_SHIFT);
+     return size_class < PALLOC_BOUNDS_CLASSES && ((uintptr_t)(ptr) >> PALLOC_BOUNDS_CLASS_SHIFT)==(region >> PALLOC_BOUNDS_CLASS_SHIFT);
+}
+
+/*Size of the chunk ptr points into.*/
+static inline size_t palloc_object_size(const void* ptr)
+{
+     int size_class = palloc_size_class(ptr);
+     int order = size_class >> PALLOC_BOUNDS_SUBCLASS_BITS;
+     return ((size_t)(8) << order >> PALLOC_BOUNDS_SUBCLASS_BITS) * ((1 << PALLOC_BOUNDS_SUBCLASS_BITS) + (size_class & ((1 << PALLOC_BOUNDS_SUBCLASS_BITS) - 1)));
+}
+
+/*Start of the chunk ptr points into.*/
+static inline void* palloc_object_base(const void* ptr)
+{
+     int size_class = palloc_size_class(ptr);
+     int order = size_class >> PALLOC_BOUNDS_SUBCLASS_BITS;
+     uintptr_t superpage_size = order >= PALLOC_BOUNDS_SINGLETON_ORDER ? PALLOC_BOUNDS_MIN_SUPERPAGE << (order - PALLOC_BOUNDS_SINGLETON_OFFSET) :
+          PALLOC_BOUNDS_MIN_SUPERPAGE << (order < PALLOC_BOUNDS_MAX_SUPERPAGE_ORDER ? order : PALLOC_BOUNDS_MAX_SUPERPAGE_ORDER);
+     uintptr_t superpage = (uintptr_t)(ptr) & ~(superpage_size - 1);
+     uint64_t reciprocal = (PALLOC_BOUNDS_RECIPROCALS >> (16 * (size_class & ((1 << PALLOC_BOUNDS_SUBCLASS_BITS) - 1)))) & 0xffff;
+     uintptr_t index = ((((uintptr_t)(ptr) - superpage) >> (1 + order)) * reciprocal) >> 16;
+     return (void*)(superpage + index * palloc_object_size(ptr));
+}
+
+/*Whether derived (say ptr plus some offset) is still inside the chunk ptr points into.
+  One past the end is out of bounds.*/
+static inline int palloc_in_bounds(const void* ptr, const void* derived)
+{
+     return (uintptr_t)(derived) - (uintptr_t)(palloc_object_base(ptr)) < palloc_object_size(ptr);
+}
+
+#endif
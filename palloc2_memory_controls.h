@@ -10,37 +10,29 @@
 
 #include <dlfcn.h>
 #include <stdlib.h>
-#include <strings.h>
 
 #include <unistd.h>
 #include <sys/syscall.h>
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-
-/*We need to steal five bits of the address to use for class identification.
+/*We need to steal seven bits of the address to use for class identification.
  * This is our approach for accomplishing that:
  * - Use the top two bits of the address space for conflict avoidance control.
- * - Use the next 5 bits for class identification.
- * - Set the next bit to "1" so that we start allocating in approximately the middle of the size class.
- * - Next time we call mmap for this size class, request one superpage below or above the last returned address
- *    (depending on whether the last returned address was above or below what we were returned).
+ * - Use the next 7 bits for class identification (5 bits of order, 2 of subclass).
+ *   That leaves each size class 512GB of address space.
+ * - Hand out superpages from each class's region in order, skipping anything already mapped
+ *   (see mmap_address_class).
  */
 
-static inline int check_mmap_address(size_t address_to_check, int address_class)
-{
-	size_t to_return = address_to_check;
-	to_return &= ~(3L << 46);
-	to_return >>= 41;
+#define PALLOC_CLASS_ADDRESS_SHIFT 39
 
-	return to_return==address_class && address_to_check%(MIN_SUPERPAGE_SIZE << address_class)==0;
-}
+/*The upper half of each class's region holds the superpages of arenas (see palloc2_arena.h),
+  so free() can tell their chunks apart without looking at the page.*/
+#define PALLOC_ARENA_ADDRESS_BIT (1L << (PALLOC_CLASS_ADDRESS_SHIFT - 1))
 
 static inline int get_size_class_from_address(size_t to_return)
 {
 	to_return &= ~(3L << 46);
-	to_return >>= 41;
+	to_return >>= PALLOC_CLASS_ADDRESS_SHIFT;
 
 	return to_return;
 }
@@ -48,211 +40,133 @@ static inline int get_size_class_from_address(size_t to_return)
 #define C_AVOID_0 0x0000200000000000
 #define C_AVOID_1 0x0000400000000000
 
-//We need to override mmap and munmap to lock them against races
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
 
-static plocklib_simple_t mmap_lock;
+/*Each size class owns its 512GB slice of the address space and hands out
+  superpages from it with a per-class cursor bumped by fetch-and-add.
+  The superpage is then mapped with MAP_FIXED_NOREPLACE: if something else
+  (the executable, the brk heap, another library's mapping) is already there,
+  the kernel says so and we just take the next slot.  No locks, no file I/O.
+  The cursor wraps around the region, which is how address space given back
+  with munmap gets reused.  Arenas have their own cursors for their half of the region.*/
+static uint64_t next_offset_for_class[NUM_PALLOC_BUCKETS*2];
 
-#if 0
-static void* (*real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
-void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+static inline size_t class_region_start(uint64_t address_class)
 {
-     if(!real_mmap)
-          real_mmap = dlsym(((void*) -1l),"mmap");
-
-     plocklib_acquire_simple_lock(&mmap_lock);
-     void* retval = real_mmap(addr,length,prot,flags,fd,offset);
-     plocklib_release_simple_lock(&mmap_lock);
-     return retval;
+     return (PALLOC_CLASS_ORDER(address_class) > 15 ? C_AVOID_0 : C_AVOID_1) | (address_class << PALLOC_CLASS_ADDRESS_SHIFT);
 }
 
-static int (*real_munmap)(void* addr, size_t length);
-int munmap(void *addr, size_t length)
-{
-     if(!real_munmap)
-          real_munmap = dlsym(((void*) -1l),"munmap");
-     
-     plocklib_acquire_simple_lock(&mmap_lock);
-     int retval = real_munmap(addr,length);
-     plocklib_release_simple_lock(&mmap_lock);
-     return retval;
-}
-#endif
+/*-1 until the first superpage is mapped, then whether PALLOC_HUGEPAGES was set.
+  It can't change after that: the span size depends on it.*/
+static int hugepage_mode = -1;
 
-//Returns 1 if there is another line in /proc/self/maps, 0 otherwise
-static char sbuffer[100];
-static int sbuf_pos;
-static int next_mapping(int fd, char* rbuf)
+static inline int use_hugepages()
 {
-     int read_chars;
-     int garbage_mode = 0;
-     int rbuf_pos = 0;
-
-     while(1)
+     if(unlikely (hugepage_mode < 0))
      {
-          if(!sbuf_pos)
-          {
-               read_chars = read(fd,sbuffer,100);
-               if(!read_chars)
-                    return rbuf_pos!=0;
-               else if(read_chars<100)
-                    sbuffer[read_chars]='\0';
-          }
-
-          while(sbuf_pos<100 && sbuffer[sbuf_pos])
-               if(garbage_mode)
-               {
-                    if(sbuffer[sbuf_pos++]=='\n')
-                    {
-                         garbage_mode = 0;
-                         if(rbuf_pos)
-                              return 1;
-                    }
-               }
-               else
-               {
-                    rbuf[rbuf_pos++] = sbuffer[sbuf_pos];
-                    if(sbuffer[sbuf_pos++]==' ')
-                         garbage_mode = 1;
-               }
-
-          sbuf_pos = 0;
+          const char* setting = getenv("PALLOC_HUGEPAGES");
+          hugepage_mode = setting && *setting && *setting!='0';
      }
-
-     return 1;
+     return hugepage_mode;
 }
 
-/*Open and parse /proc/self/maps to find out if a memory range is free.
-  Oh my Cthulhu is this ugly.
+static inline void advise_hugepages(void* address, size_t size)
+{
+     if(use_hugepages())
+          madvise(address,size,MADV_HUGEPAGE);
+}
 
-  begin is inclusive and end exclusive.
-  Must only be called with mmap_lock held.*/
-static int is_memory_range_free(size_t begin, size_t end)
+static void* mmap_address_class(uint64_t address_class, uint64_t effective_address_class, int arena)
 {
-     int fd = open("/proc/self/maps",O_RDONLY);
-     char buffer[100];
-     size_t range_begin;
-     size_t range_end;
-     int retval = 1;
+     dbgprintf("mmap_address_class: %zd, effective address class %zd\n",address_class,effective_address_class);
+     size_t region_start = class_region_start(address_class) | (arena ? PALLOC_ARENA_ADDRESS_BIT : 0);
+     uint64_t superpage_size = MIN_SUPERPAGE_SIZE << effective_address_class;
+     uint64_t attempts;
 
-     while(next_mapping(fd,buffer))
+     for(attempts = 0; attempts < PALLOC_ARENA_ADDRESS_BIT / superpage_size; attempts++)
      {
-          char ibuf[50];
-          int i=0, j=0;
-          int length = 0;
-
-          bzero(ibuf,50);
-          while(1)
-               if(buffer[i]=='-')
-                    break;
-               else
-                    ibuf[j++] = buffer[i++];
+          uint64_t offset = plocklib_fetch_and_add(next_offset_for_class + address_class + (arena ? NUM_PALLOC_BUCKETS : 0),superpage_size) & (PALLOC_ARENA_ADDRESS_BIT - 1);
+          void* wanted = (void*)(region_start + offset);
+          void* to_return = mmap(wanted,superpage_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE,-1,0);
 
-          range_begin = strtoul(ibuf,NULL,16);
-          j=0;
-          i++;
-
-          bzero(ibuf,50);
-          while(1)
-               if(buffer[i]==' ')
-                    break;
-               else
-                    ibuf[j++] = buffer[i++];
-          range_end = strtoul(ibuf,NULL,16);
-
-          if(end <= range_begin)
+          if(to_return==wanted)
           {
-               retval = 1;
-               break;
+               if(superpage_size >= PALLOC_HUGEPAGE_SIZE)
+                    advise_hugepages(to_return,superpage_size);
+               return to_return;
           }
-          else if(range_end <= begin)
-               continue;
-          else
-          {
-               retval = 0;
+          if(to_return!=MAP_FAILED) /*kernels before 4.17 treat the address as a hint*/
+               munmap(to_return,superpage_size);
+          else if(errno!=EEXIST)
                break;
-          }
      }
 
-     close(fd);
+     dbgprintf("palloc: mmap_address_class failed\n");
+     abort();
+}
 
-     bzero(sbuffer,100);
-     sbuf_pos = 0;
+/*Remote free buffers live on a lock-free stack.
+  The top PALLOC_RFREE_TAG_BITS of the head are a counter bumped by every push and pop,
+  so a pop that raced with a pop and a push of the same buffer fails its CAS (no ABA).
+  Buffers are never unmapped, so reading the link of a buffer someone else just popped is harmless.
+  An empty stack is refilled with a whole MIN_SUPERPAGE_SIZE worth of buffers at once.*/
+#define PALLOC_RFREE_TAG_BITS 16
+#define PALLOC_RFREE_POINTER_MASK ((1UL << (64 - PALLOC_RFREE_TAG_BITS)) - 1)
+#define PALLOC_RFREE_TAG_INCREMENT (1UL << (64 - PALLOC_RFREE_TAG_BITS))
 
-     return retval;
-}
+static uint64_t rfree_stack;
 
-static void* mmap_address_class(uint64_t address_class, uint64_t effective_address_class)
+/*Push the chain first .. last (linked through their first words) in one go.*/
+static inline void push_rfree_buffers(uint64_t* first, uint64_t* last)
 {
-     dbgprintf("mmap_address_class: %zd, effective address class %zd\n",address_class,effective_address_class);
-     static size_t next_attempt_for_class[] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-     
-     void* to_return = (void*)(-1);
-     size_t range_end = (uint64_t)(-1);
-     
-     plocklib_acquire_simple_lock(&mmap_lock);
-
+     uint64_t head;
      do
      {
-          if(!next_attempt_for_class[address_class])
-               next_attempt_for_class[address_class] = (address_class > 15 ? C_AVOID_0 : C_AVOID_1) | (address_class << 41);
-          
-          to_return = next_attempt_for_class[address_class];
-          next_attempt_for_class[address_class] = range_end = (size_t)to_return + (MIN_SUPERPAGE_SIZE << address_class);
-     } while(!is_memory_range_free((size_t)to_return,range_end));
-
-     if(!mmap(to_return,MIN_SUPERPAGE_SIZE << effective_address_class,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0))
-     {
-          dbgprintf("palloc: mmap_address_class failed\n");
-          abort();
-     }
-
-     
-     plocklib_release_simple_lock(&mmap_lock);
-
-     return to_return;
+          head = *(volatile uint64_t*)(&rfree_stack);
+          *last = head & PALLOC_RFREE_POINTER_MASK;
+     } while(!plocklib_cas64(&rfree_stack,head,((head & ~PALLOC_RFREE_POINTER_MASK) + PALLOC_RFREE_TAG_INCREMENT) | (uint64_t)(first)));
 }
 
-static plocklib_simple_t global_rfree_lock;
-static uint64_t* next_rfree_buffer;
-
 static uint64_t* get_rfree_buffer()
 {
 	dbgprintf("get_rfree_buffer\n");
     uint64_t* to_return;
+    uint64_t head;
 
-    plocklib_acquire_simple_lock(&global_rfree_lock);
-    dbgprintf("get_rfree_buffer chkpt 1\n");
-    assert(next_rfree_buffer!=(uint64_t*)(-1));
-    if(next_rfree_buffer==NULL)
+    do
     {
-    	dbgprintf("NULL rfree buffer\n");
-    	next_rfree_buffer = (uint64_t*)(mmap(NULL,MIN_SUPERPAGE_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0));
-    	assert(next_rfree_buffer!=(uint64_t*)(-1));
-
-    	uint64_t* i;
-    	for(i = next_rfree_buffer; i+2*PALLOC_BITVEC_ENTRIES <= (uint64_t*)((size_t)next_rfree_buffer + MIN_SUPERPAGE_SIZE); i+=PALLOC_BITVEC_ENTRIES)
-    		*i = (size_t)(i+PALLOC_BITVEC_ENTRIES);
-    }
+         head = *(volatile uint64_t*)(&rfree_stack);
+         to_return = (uint64_t*)(head & PALLOC_RFREE_POINTER_MASK);
+         if(!to_return)
+         {
+              dbgprintf("get_rfree_buffer: refilling\n");
+              to_return = (uint64_t*)(mmap(NULL,MIN_SUPERPAGE_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0));
+              if(to_return==(uint64_t*)(-1))
+              {
+                   dbgprintf("palloc: could not map remote free buffers\n");
+                   abort();
+              }
+
+              /*Keep the first buffer and hand the rest to the stack.*/
+              uint64_t* i;
+              uint64_t* last = (uint64_t*)((size_t)to_return + MIN_SUPERPAGE_SIZE) - PALLOC_BITVEC_ENTRIES;
+              for(i = to_return + PALLOC_BITVEC_ENTRIES; i < last; i+=PALLOC_BITVEC_ENTRIES)
+                   *i = (size_t)(i+PALLOC_BITVEC_ENTRIES);
+              push_rfree_buffers(to_return + PALLOC_BITVEC_ENTRIES,last);
+              break;
+         }
+    } while(!plocklib_cas64(&rfree_stack,head,((head & ~PALLOC_RFREE_POINTER_MASK) + PALLOC_RFREE_TAG_INCREMENT) | *(volatile uint64_t*)(to_return)));
 
-    to_return = next_rfree_buffer;
     dbgprintf("get_rfree_buffer: to_return: 0x%zx\n",to_return);
-    next_rfree_buffer = (uint64_t*)(*to_return);
-    dbgprintf("get_rfree_buffer chkpt 2\n");
-
-    plocklib_release_simple_lock(&global_rfree_lock);
-
-    dbgprintf("get_rfree_buffer chkpt 3\n");
     memset(to_return,-1,sizeof(uint64_t)*PALLOC_BITVEC_ENTRIES);
     return to_return;
 }
 
-static void release_rfree_buffer(uint64_t* to_free)
+static inline void release_rfree_buffer(uint64_t* to_free)
 {
-    plocklib_acquire_simple_lock(&global_rfree_lock);
-    *to_free = (size_t)next_rfree_buffer;
-    next_rfree_buffer = to_free;
-    assert(next_rfree_buffer!=(uint64_t*)(-1));
-    plocklib_release_simple_lock(&global_rfree_lock);
+    push_rfree_buffers(to_free,to_free);
 }
 
 #endif /* PALLOC2_MEMORY_CONTROLS_H_ */
@@ -0,0 +1,9 @@
+#ifndef PALLOC2_PROFILE_H
+#define PALLOC2_PROFILE_H
+
+/*Write the sampled heap profile to path in gperftools heap_v2 format.
+  Profiling must have been turned on with PALLOC_PROFILE at startup.
+  Returns 0 on success, -1 with errno set otherwise.*/
+int palloc_dump_profile(const char* path);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef PALLOC2_STATS_H
+#define PALLOC2_STATS_H
+
+/*Allocator statistics.
+
+  Every thread keeps its own counters, so reading them is cheap for the
+  allocator and only approximate for you: totals are summed across threads
+  without stopping them.  mallinfo2, malloc_stats and malloc_info from
+  <malloc.h> are also provided.  Set PALLOC_STATS in the environment to
+  have malloc_stats() run at exit.*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct palloc_class_stats
+{
+     int size_class;
+     size_t chunk_size;
+     uint64_t allocations;
+     uint64_t frees; /*including remote frees*/
+     uint64_t remote_frees; /*frees by a thread other than the one owning the superpage*/
+     uint64_t superpages_mapped; /*superpages mapped fresh, not reused*/
+     size_t bytes_live;
+     size_t bytes_mapped; /*currently mapped, including superpages cached while empty*/
+};
+
+/*Fill in stats for up to max_classes size classes that have seen any use,
+  smallest first.  Returns the number of such classes, which may be more
+  than max_classes.*/
+size_t palloc_get_class_stats(struct palloc_class_stats* stats, size_t max_classes);
+
+/*Bytes of our mappings the kernel is currently backing with transparent huge pages
+  (see PALLOC_HUGEPAGES).  This reads /proc/self/smaps, so it is slow.*/
+size_t palloc_get_hugepage_bytes(void);
+
+#endif
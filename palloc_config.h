@@ -74,7 +74,28 @@ static inline int popcount(uint64_t word)
   take more bits out of the address space as well.
   It actually probably just won't work.
 */
-#define NUM_PALLOC_BUCKETS 31
+#define NUM_PALLOC_ORDERS 31
+
+/*Each power of two ("order") is split into PALLOC_SUBCLASSES size classes:
+  1, 1.25, 1.5 and 1.75 times the power of two.
+  A size class is (order << PALLOC_SUBCLASS_BITS) | subclass, and that is
+  also what gets encoded into the address, so the lookup stays a shift.
+  Orders below PALLOC_MIN_SUBCLASS_ORDER (8..32 bytes) and the absurdly huge
+  orders have only the power-of-two class; the other indices are never used.
+  Starting at order 3 keeps everything of 64 bytes or more 16-byte aligned.*/
+#define PALLOC_SUBCLASS_BITS 2
+#define PALLOC_SUBCLASSES (1 << PALLOC_SUBCLASS_BITS)
+#define PALLOC_MIN_SUBCLASS_ORDER 3
+#define NUM_PALLOC_BUCKETS (((NUM_PALLOC_ORDERS - 1) << PALLOC_SUBCLASS_BITS) + 1)
+
+#define PALLOC_CLASS_ORDER(size_class) ((size_class) >> PALLOC_SUBCLASS_BITS)
+#define PALLOC_CLASS_SUBCLASS(size_class) ((size_class) & (PALLOC_SUBCLASSES - 1))
+#define PALLOC_ORDER_HAS_SUBCLASSES(order) ((order) >= PALLOC_MIN_SUBCLASS_ORDER && (order) < PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS)
+
+/*2^16/4, 2^16/5, 2^16/6 and 2^16/7 (rounded up), one per 16 bits.
+  Chunk indices are at most 2048 after the shift in palloc_chunk_index,
+  which is small enough for these to divide exactly.*/
+#define PALLOC_SUBCLASS_RECIPROCALS 0x24932AAB33344000UL
 
 /*This must be a multiple of 64 or I will throw a sheep at you.*/
 #define PALLOC_PAGE_ENTRIES 512
@@ -84,7 +105,81 @@ static inline int popcount(uint64_t word)
 const static int MIN_SET_BIT = /*fls64(MIN_SIZE_CLASS) = */ 3;
 #define MIN_SUPERPAGE_SIZE ( (int64_t) (MIN_SIZE_CLASS * PALLOC_PAGE_ENTRIES) )
 
-#define PALLOC_MAX_THREADS 128
+/*Thread records are allocated PALLOC_THREAD_CHUNK at a time as threads show up.
+  owning_thread is 16 bits, so this must stay below 65536.*/
+#define PALLOC_MAX_THREADS 16384
+#define PALLOC_THREAD_CHUNK 64
+
+/*owning_thread values for superpages whose thread has exited.
+  An orphaned page was full when its owner left and goes to the first thread that frees into it;
+  a pooled page is waiting in its class's orphan pool to be adopted.*/
+#define PALLOC_ORPHANED_OWNER PALLOC_MAX_THREADS
+#define PALLOC_POOLED_OWNER (PALLOC_MAX_THREADS + 1)
+
+/*Remote frees are held back by the freeing thread and applied to a page PALLOC_REMOTE_BATCH_FREES at a time,
+  so the owner's bitmap and counters are touched once per batch rather than once per free.
+  Each thread has PALLOC_REMOTE_BATCH_PAGES batches, picked by hashing the page address;
+  a page that hashes to a batch in use by another page flushes it.*/
+#define PALLOC_REMOTE_BATCH_PAGES 16
+#define PALLOC_REMOTE_BATCH_FREES 32
+
+/*Each thread keeps freed chunks of the classes below PALLOC_CHUNK_CACHE_CLASSES (up to 1792 bytes)
+  on a LIFO list per class, linked through the chunks themselves, and malloc takes them back from there
+  without going near the page.  A list that reaches PALLOC_CHUNK_CACHE_ENTRIES has its older half
+  freed into the bitmaps.*/
+#define PALLOC_CHUNK_CACHE_CLASSES (8 << PALLOC_SUBCLASS_BITS)
+#define PALLOC_CHUNK_CACHE_ENTRIES 64
+
+/*memalign and friends take an aligned chunk of the requested size's own class when one comes up
+  at least every PALLOC_ALIGNED_MAX_STRIDE chunks, looking through the first PALLOC_ALIGNED_SEARCH_PAGES
+  pages of the chain and its bins before starting a new one.  Bigger alignments use a class that is aligned enough.*/
+#define PALLOC_ALIGNED_MAX_STRIDE 64
+#define PALLOC_ALIGNED_SEARCH_PAGES 4
+
+/*Each thread allocates from one page per size class, the head of its chain.  The class's other pages
+  with free chunks wait in PALLOC_PAGE_BINS lists by how full they are, and the fullest one takes over
+  when the head fills up, so sparse pages are left alone to empty out and be released.*/
+#define PALLOC_PAGE_BINS 4
+
+/*Heap profiler (see profilelib.h).*/
+#define PALLOC_PROFILE_DEFAULT_RATE (512L << 10)
+#define PALLOC_PROFILE_MAX_DEPTH 32
+#define PALLOC_PROFILE_BUCKETS 8192 /*distinct stacks*/
+#define PALLOC_PROFILE_SAMPLES 65536 /*live sampled allocations*/
+
+/*Superpages smaller than this are not mapped one at a time.
+  Each thread maps a whole span for the size class and carves superpages
+  off it, so the 8-byte class needs one mmap per 32768 allocations instead of
+  one per 500.  Every superpage keeps its own page_record and bitmap, so the
+  address-to-header lookup in free() does not change.*/
+#define PALLOC_SPAN_ORDER 6 /*log_2(PALLOC_SPAN_SIZE / MIN_SUPERPAGE_SIZE)*/
+#define PALLOC_SPAN_SIZE (MIN_SUPERPAGE_SIZE << PALLOC_SPAN_ORDER)
+#define PALLOC_SPAN_CLASSES (PALLOC_SPAN_ORDER << PALLOC_SUBCLASS_BITS)
+
+/*Transparent huge pages, if PALLOC_HUGEPAGES is set in the environment.
+  Every mapping of PALLOC_HUGEPAGE_SIZE or more is already aligned to its size and gets MADV_HUGEPAGE,
+  and spans grow to PALLOC_HUGEPAGE_SIZE and cover every class with smaller superpages,
+  so small classes are packed into huge pages too.*/
+#define PALLOC_HUGEPAGE_ORDER 9 /*log_2(PALLOC_HUGEPAGE_SIZE / MIN_SUPERPAGE_SIZE)*/
+#define PALLOC_HUGEPAGE_SIZE (MIN_SUPERPAGE_SIZE << PALLOC_HUGEPAGE_ORDER)
+#define PALLOC_HUGEPAGE_SPAN_CLASSES (PALLOC_HUGEPAGE_ORDER << PALLOC_SUBCLASS_BITS)
+
+/*Completely empty superpages are kept around for reuse, up to this many bytes
+  (but always at least one superpage) per size class.  The rest are unmapped.*/
+#define PALLOC_EMPTY_SUPERPAGE_CACHE_BYTES (16L << 20)
+
+/*Freed mappings of the absurdly huge classes are kept for reuse:
+  up to PALLOC_HUGE_THREAD_CACHE_BYTES by the freeing thread, where only it can use them,
+  then up to PALLOC_HUGE_CACHE_BYTES in total shared by every thread.  The rest are unmapped.*/
+#define PALLOC_HUGE_THREAD_CACHE_BYTES (32L << 20)
+#define PALLOC_HUGE_CACHE_BYTES (256L << 20)
+
+/*Cached empty superpages and huge mappings go back to the OS once they have waited this long (see purgelib.h).
+  PALLOC_DECAY_MS in the environment overrides it; -1 keeps them until malloc_trim().
+  A purge runs at most PALLOC_PURGES_PER_DECAY times per decay period, so memory goes back
+  between one and 1.25 periods after it was freed.*/
+#define PALLOC_DEFAULT_DECAY_MS 10000
+#define PALLOC_PURGES_PER_DECAY 4
 
 /*This is how much memory to mmap per page_record structure.*/
 #define PALLOC_RECORD_FREELIST_CHUNK_SIZE 65536
@@ -96,4 +191,45 @@ const static int MIN_SET_BIT = /*fls64(MIN_SIZE_CLASS) = */ 3;
 #define PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS 21
 #define PALLOC_HACK_SINGLETON_MMAP_OFFSET 9 /*log_2(MIN_SUPERPAGE_SIZE)-3*/
 
+/*The next size class down, skipping the subclass indices that aren't used.*/
+static inline int palloc_smaller_class(int size_class)
+{
+	int order = PALLOC_CLASS_ORDER(size_class);
+	if(PALLOC_CLASS_SUBCLASS(size_class))
+		return size_class - 1;
+	order--;
+	return PALLOC_ORDER_HAS_SUBCLASSES(order) ? (order << PALLOC_SUBCLASS_BITS) | (PALLOC_SUBCLASSES - 1) : order << PALLOC_SUBCLASS_BITS;
+}
+
+/*Every chunk of a size class is aligned to this: the size itself for the power-of-two classes,
+  the largest power of two dividing it for the others.  Superpages are aligned to their own size.*/
+static inline size_t palloc_class_alignment(int size_class)
+{
+	return ((size_t)(MIN_SIZE_CLASS) << PALLOC_CLASS_ORDER(size_class) >> PALLOC_SUBCLASS_BITS) << __builtin_ctz(PALLOC_SUBCLASSES + PALLOC_CLASS_SUBCLASS(size_class));
+}
+
+/*Chunk size of a size class.*/
+static inline size_t palloc_class_size(int size_class)
+{
+	return ((size_t)(MIN_SIZE_CLASS) << PALLOC_CLASS_ORDER(size_class) >> PALLOC_SUBCLASS_BITS) * (PALLOC_SUBCLASSES + PALLOC_CLASS_SUBCLASS(size_class));
+}
+
+/*Size of the superpage (or singleton mapping) holding chunks of a size class.*/
+static inline uint64_t palloc_superpage_size(int size_class)
+{
+	int order = PALLOC_CLASS_ORDER(size_class);
+	if(order >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS)
+		return MIN_SUPERPAGE_SIZE << (order - PALLOC_HACK_SINGLETON_MMAP_OFFSET);
+	return MIN_SUPERPAGE_SIZE << min(order,PALLOC_HACK_MAX_SIZE_CLASS);
+}
+
+/*Index of the chunk byte_offset bytes into its superpage.
+  chunk size = (MIN_SIZE_CLASS << order) / 4 * (4 + subclass), so shift out the
+  power of two and divide the rest by 4..7 with a multiply.*/
+static inline int palloc_chunk_index(size_t byte_offset, int size_class)
+{
+	uint64_t reciprocal = (PALLOC_SUBCLASS_RECIPROCALS >> (16 * PALLOC_CLASS_SUBCLASS(size_class))) & 0xffff;
+	return ((byte_offset >> (MIN_SET_BIT - PALLOC_SUBCLASS_BITS + PALLOC_CLASS_ORDER(size_class))) * reciprocal) >> 16;
+}
+
 #endif
@@ -7,6 +7,24 @@
 
 typedef uint8_t plocklib_simple_t;
 
+/*A lock that spins for a while, backing off, and then sleeps until it is released.
+  Use it for anything held across a system call or long enough to be preempted in;
+  simple locks are for short critical sections with little contention.
+  state is 0 when free, 1 when held and 2 when held with someone (maybe) asleep.
+  Build with -DPLOCKLIB_CONTENTION_STATS to count how often acquiring it had to wait.*/
+typedef struct
+{
+     uint32_t state;
+#ifdef PLOCKLIB_CONTENTION_STATS
+     uint64_t contended; /*acquisitions that didn't get it straight away*/
+     uint64_t sleeps; /*times a waiter went to sleep*/
+#endif
+} plocklib_adaptive_t;
+
+/*Rounds of spinning before sleeping, and the most pauses in one round.*/
+#define PLOCKLIB_SPIN_ROUNDS 10
+#define PLOCKLIB_MAX_BACKOFF 64
+
 static inline void plocklib_simple_init(plocklib_simple_t* lock)
 {
 }
@@ -15,8 +33,13 @@ static inline void plocklib_simple_destroy(plocklib_simple_t* lock)
 {
 }
 
+static inline void plocklib_adaptive_init(plocklib_adaptive_t* lock)
+{
+}
+
 #ifdef __SUNPRO_C
 
+#include <sched.h>
 #include <sys/atomic.h>
 
 static inline int16_t plocklib_increment_and_fetch(uint16_t* to_increment)
@@ -30,11 +53,21 @@ static inline uint64_t plocklib_fetch_and_ffffffffffffffff(uint64_t* to_clear)
 	return atomic_swap_64(to_clear, (uint64_t)(-1));
 }
 
+static inline uint64_t plocklib_fetch_and_add(uint64_t* to_add, uint64_t delta)
+{
+	return atomic_add_64_nv(to_add,delta) - delta;
+}
+
 static inline void plocklib_atomic_add(uint16_t* to_add, int add_amount)
 {
 	atomic_add_16(to_add,add_amount);
 }
 
+static inline uint64_t plocklib_fetch_and_store64(uint64_t* target, uint64_t newval)
+{
+	return atomic_swap_64(target,newval);
+}
+
 static inline void plocklib_atomic_and(uint64_t* to_and, uint64_t mask)
 {
 	atomic_and_64(to_and,mask);
@@ -68,6 +101,20 @@ static inline void plocklib_acquire_simple_lock(plocklib_simple_t* lock)
      membar_enter();
 }
 
+/*No futexes here, so waiters yield instead of sleeping.*/
+static inline void plocklib_acquire_adaptive_lock(plocklib_adaptive_t* lock)
+{
+     while(atomic_cas_32(&lock->state,0,1))
+          sched_yield();
+     membar_enter();
+}
+
+static inline void plocklib_release_adaptive_lock(plocklib_adaptive_t* lock)
+{
+     membar_exit();
+     atomic_swap_32(&lock->state,0);
+}
+
 static inline void plocklib_release_simple_lock(plocklib_simple_t* lock)
 {
      unsigned int x = atomic_cas_8((uint8_t*)lock,1,0);
@@ -112,12 +159,17 @@ static inline void plocklib_resign_as_writer(struct plocklib_rw_lock* lock)
 }
 
 #else
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 static inline int16_t plocklib_increment_and_fetch(int16_t* to_increment)
 {
 	return __sync_add_and_fetch(to_increment,1);
 }
 
-static inline uint64_t plocklib_fetch_and_add(uint64_t* to_add, int delta)
+static inline uint64_t plocklib_fetch_and_add(uint64_t* to_add, uint64_t delta)
 {
 	return __sync_fetch_and_add(to_add,delta);
 }
@@ -133,6 +185,12 @@ static inline void plocklib_atomic_add(uint16_t* to_add, int delta)
 	__sync_fetch_and_add(to_add,delta);
 }
 
+static inline uint64_t plocklib_fetch_and_store64(uint64_t* target, uint64_t newval)
+{
+	/*xchg -- also an implied full memory barrier on x86-64*/
+	return __sync_lock_test_and_set(target,newval);
+}
+
 static inline void plocklib_atomic_and(uint64_t* to_and, uint64_t mask)
 {
 	__sync_fetch_and_and(to_and,mask);
@@ -163,6 +221,56 @@ static inline void plocklib_release_simple_lock(plocklib_simple_t* lock)
      __sync_lock_release(lock);
 }
 
+static inline void plocklib_cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+     __builtin_ia32_pause();
+#elif defined(__aarch64__)
+     asm volatile("yield");
+#endif
+}
+
+static void __attribute__ ((noinline)) plocklib_wait_adaptive_lock(plocklib_adaptive_t* lock)
+{
+     int round, backoff, i;
+
+#ifdef PLOCKLIB_CONTENTION_STATS
+     __sync_fetch_and_add(&lock->contended,1);
+#endif
+     for(round = 0, backoff = 1; round < PLOCKLIB_SPIN_ROUNDS; round++, backoff = backoff < PLOCKLIB_MAX_BACKOFF ? backoff*2 : backoff)
+     {
+          for(i = 0; i < backoff; i++)
+               plocklib_cpu_relax();
+          if(!*(volatile uint32_t*)(&lock->state) && __sync_bool_compare_and_swap(&lock->state,0,1))
+               return;
+     }
+
+     /*Mark the lock as having sleepers; if it was free, we just took it.*/
+     while(__sync_lock_test_and_set(&lock->state,2))
+     {
+#ifdef PLOCKLIB_CONTENTION_STATS
+          __sync_fetch_and_add(&lock->sleeps,1);
+#endif
+          syscall(SYS_futex,&lock->state,FUTEX_WAIT_PRIVATE,2,NULL,NULL,0);
+     }
+}
+
+static inline void plocklib_acquire_adaptive_lock(plocklib_adaptive_t* lock)
+{
+     if(__builtin_expect(!__sync_bool_compare_and_swap(&lock->state,0,1),0))
+          plocklib_wait_adaptive_lock(lock);
+}
+
+static inline void plocklib_release_adaptive_lock(plocklib_adaptive_t* lock)
+{
+     if(__builtin_expect(__sync_fetch_and_sub(&lock->state,1)!=1,0))
+     {
+          /*Somebody may be asleep.  Whoever we wake marks it 2 again, so later releases keep waking.*/
+          *(volatile uint32_t*)(&lock->state) = 0;
+          syscall(SYS_futex,&lock->state,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
+     }
+}
+
 struct plocklib_rw_lock
 {
      volatile int readers;
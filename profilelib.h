@@ -0,0 +1,310 @@
+#ifndef PROFILELIB_H
+#define PROFILELIB_H
+
+/*Sampling heap profiler.
+
+  Set PALLOC_PROFILE to a file name to turn it on; the profile is written there
+  at exit, and palloc_dump_profile() writes one whenever you like.  About one
+  allocation per PALLOC_PROFILE_RATE bytes (default PALLOC_PROFILE_DEFAULT_RATE)
+  is sampled: each thread counts down the bytes it allocates and takes a sample
+  when the count goes negative, with exponentially distributed gaps so every byte
+  is equally likely to be picked.  Only sampled allocations pay for a backtrace.
+
+  The output is the gperftools heap_v2 text format, which pprof reads and scales
+  back up by the sampling rate.*/
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <link.h>
+#include <math.h>
+
+/*Allocations with the same stack.  Never removed, so cumulative counts survive.*/
+struct profile_bucket
+{
+     uint64_t hash; /*0 means unused*/
+     uint64_t allocations;
+     uint64_t allocated_bytes;
+     uint64_t frees;
+     uint64_t freed_bytes;
+     int depth;
+     void* stack[PALLOC_PROFILE_MAX_DEPTH];
+};
+
+/*A live sampled allocation.
+  Slots go from empty to used and from used to PALLOC_PROFILE_RETIRED and back, but never back to empty,
+  so a lookup that doesn't take profile_lock still finds anything inserted before it started.*/
+struct profile_sample
+{
+     void* address;
+     uint64_t size;
+     uint32_t bucket;
+};
+#define PALLOC_PROFILE_RETIRED ((void*)(1))
+
+/*Both tables are open addressed.  Lookups give up after this many slots,
+  so a full table drops new samples instead of slowing every free down.*/
+#define PALLOC_PROFILE_MAX_PROBE 64
+
+/*Most of our own frames a sampled backtrace can start with (see profile_find_text).*/
+#define PALLOC_PROFILE_OWN_FRAMES 8
+
+static plocklib_adaptive_t profile_lock;
+static int64_t profile_rate; /*0 when not profiling*/
+static const char* profile_path;
+static struct profile_bucket* profile_buckets;
+static struct profile_sample* profile_samples;
+static uint64_t profile_live_samples;
+static size_t profile_text_start, profile_text_end; /*our own code, when we are a shared library*/
+
+static inline uint64_t profile_hash_address(void* address)
+{
+     return ((size_t)(address) >> MIN_SET_BIT) * 0x9E3779B97F4A7C15UL;
+}
+
+/*dl_iterate_phdr callback: finds the executable segment holding this function.
+  Sampled stacks drop every frame in it, so they start at the caller however many
+  of our functions (malloc, calloc, the aligned calls, operator new) it went through and
+  whether or not the compiler inlined them.  If we are linked into the program itself,
+  that segment is the program's too, so then only sample_allocation's frame is dropped.*/
+static int profile_find_text(struct dl_phdr_info* info, size_t info_size, void* unused)
+{
+     size_t own_code = (size_t)(profile_find_text);
+     int i;
+
+     for(i = 0; i < info->dlpi_phnum; i++)
+     {
+          size_t start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+          if(info->dlpi_phdr[i].p_type!=PT_LOAD || !(info->dlpi_phdr[i].p_flags & PF_X) || own_code - start >= info->dlpi_phdr[i].p_memsz)
+               continue;
+          if(info->dlpi_name && *info->dlpi_name)
+          {
+               profile_text_start = start;
+               profile_text_end = start + info->dlpi_phdr[i].p_memsz;
+          }
+          return 1;
+     }
+     return 0;
+}
+
+static void profile_initialize()
+{
+     const char* rate;
+
+     profile_path = getenv("PALLOC_PROFILE");
+     if(!profile_path || !*profile_path)
+          return;
+     rate = getenv("PALLOC_PROFILE_RATE");
+     profile_rate = rate ? atol(rate) : 0;
+     if(profile_rate <= 0)
+          profile_rate = PALLOC_PROFILE_DEFAULT_RATE;
+     dl_iterate_phdr(profile_find_text,NULL);
+
+     /*Libraries that allocate in their own constructors (libstdc++ does) registered this thread before there was a rate.*/
+     if(tls_thread)
+          start_thread_profile();
+}
+
+/*Bytes to allocate before the next sample, drawn from an exponential distribution with mean profile_rate.*/
+static int64_t profile_sample_interval()
+{
+     if(!profile_rate)
+          return INT64_MAX;
+
+     /*xorshift64*; the state starts from the record address so threads don't sample in lockstep.*/
+     uint64_t x = tls_thread->profile_random ? tls_thread->profile_random : (size_t)(tls_thread) | 1;
+     x ^= x >> 12;
+     x ^= x << 25;
+     x ^= x >> 27;
+     tls_thread->profile_random = x;
+     double uniform = ((x * 0x2545F4914F6CDD1DUL) >> 11) * (1.0 / (1UL << 53));
+     return (int64_t)(-log(1.0 - uniform) * profile_rate) + 1;
+}
+
+static inline void start_thread_profile()
+{
+     tls_bytes_until_sample = profile_sample_interval();
+}
+
+/*Must be called with profile_lock held.  Returns -1 if the table is full.*/
+static int profile_find_bucket(void** stack, int depth)
+{
+     uint64_t hash = 0xcbf29ce484222325UL;
+     int i;
+
+     for(i = 0; i < depth; i++)
+          hash = (hash ^ (size_t)(stack[i])) * 0x100000001b3UL;
+     hash |= 1;
+
+     uint64_t slot = hash;
+     for(i = 0; i < PALLOC_PROFILE_MAX_PROBE; i++, slot++)
+     {
+          struct profile_bucket* bucket = profile_buckets + slot % PALLOC_PROFILE_BUCKETS;
+          if(!bucket->hash)
+          {
+               bucket->hash = hash;
+               bucket->depth = depth;
+               memcpy(bucket->stack,stack,depth*sizeof(void*));
+               return bucket - profile_buckets;
+          }
+          if(bucket->hash==hash && bucket->depth==depth && !memcmp(bucket->stack,stack,depth*sizeof(void*)))
+               return bucket - profile_buckets;
+     }
+     return -1;
+}
+
+static void __attribute__ ((noinline)) sample_allocation(void* address, size_t size, struct page_record* record)
+{
+     void* stack[PALLOC_PROFILE_MAX_DEPTH + PALLOC_PROFILE_OWN_FRAMES];
+     int depth, skip, bucket;
+     uint64_t slot, i;
+
+     /*backtrace can allocate the first time round; don't sample that.*/
+     if(tls_thread->in_profiler || !profile_rate)
+     {
+          tls_bytes_until_sample = profile_sample_interval();
+          return;
+     }
+     tls_thread->in_profiler = 1;
+     tls_bytes_until_sample = profile_sample_interval();
+
+     /*Leave out ourselves and whichever of our entry points got us here.*/
+     depth = backtrace(stack,PALLOC_PROFILE_MAX_DEPTH + PALLOC_PROFILE_OWN_FRAMES);
+     for(skip = 1; skip < depth && (size_t)(stack[skip]) - profile_text_start < profile_text_end - profile_text_start; skip++);
+     depth = min(depth - skip,PALLOC_PROFILE_MAX_DEPTH);
+
+     plocklib_acquire_adaptive_lock(&profile_lock);
+     if(!profile_buckets)
+     {
+          profile_buckets = (struct profile_bucket*)(mmap(NULL,sizeof(struct profile_bucket)*PALLOC_PROFILE_BUCKETS,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0));
+          profile_samples = (struct profile_sample*)(mmap(NULL,sizeof(struct profile_sample)*PALLOC_PROFILE_SAMPLES,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0));
+          if(profile_buckets==(struct profile_bucket*)(-1) || profile_samples==(struct profile_sample*)(-1))
+          {
+               dbgprintf("palloc: could not map profile tables, profiling off\n");
+               profile_rate = 0;
+               profile_buckets = NULL;
+               profile_samples = NULL;
+               plocklib_release_adaptive_lock(&profile_lock);
+               tls_thread->in_profiler = 0;
+               return;
+          }
+     }
+
+     bucket = depth > 0 ? profile_find_bucket(stack + skip,depth) : -1;
+     if(bucket >= 0)
+          for(i = 0, slot = profile_hash_address(address); i < PALLOC_PROFILE_MAX_PROBE; i++, slot++)
+          {
+               struct profile_sample* sample = profile_samples + slot % PALLOC_PROFILE_SAMPLES;
+               if(sample->address && sample->address!=PALLOC_PROFILE_RETIRED)
+                    continue;
+               sample->size = size;
+               sample->bucket = bucket;
+               *(void* volatile*)(&sample->address) = address;
+               profile_buckets[bucket].allocations++;
+               profile_buckets[bucket].allocated_bytes += size;
+               profile_live_samples++;
+               if(record)
+                    plocklib_atomic_add(&record->sampled_entries,1);
+               break;
+          }
+     plocklib_release_adaptive_lock(&profile_lock);
+     tls_thread->in_profiler = 0;
+}
+
+/*Called by free() for chunks that might have been sampled.*/
+static void retire_sample(void* address, struct page_record* record)
+{
+     uint64_t slot, i;
+     struct profile_sample* sample = NULL;
+
+     if(!profile_samples)
+          return;
+
+     for(i = 0, slot = profile_hash_address(address); i < PALLOC_PROFILE_MAX_PROBE; i++, slot++)
+     {
+          sample = profile_samples + slot % PALLOC_PROFILE_SAMPLES;
+          void* sampled_address = *(void* volatile*)(&sample->address);
+          if(sampled_address==address || !sampled_address)
+               break;
+     }
+     if(!sample || sample->address!=address)
+          return;
+
+     /*Nobody else can retire the same chunk, so the slot is still ours.*/
+     plocklib_acquire_adaptive_lock(&profile_lock);
+     profile_buckets[sample->bucket].frees++;
+     profile_buckets[sample->bucket].freed_bytes += sample->size;
+     sample->address = PALLOC_PROFILE_RETIRED;
+     profile_live_samples--;
+     plocklib_release_adaptive_lock(&profile_lock);
+     if(record)
+          plocklib_atomic_add(&record->sampled_entries,-1);
+}
+
+/*Formats without stdio, which could allocate.*/
+static void profile_write(int fd, const char* line, int length)
+{
+     while(length > 0)
+     {
+          ssize_t written = write(fd,line,length);
+          if(written <= 0)
+               return;
+          line += written;
+          length -= written;
+     }
+}
+
+int palloc_dump_profile(const char* path)
+{
+     char line[64 + PALLOC_PROFILE_MAX_DEPTH*20];
+     uint64_t total_live = 0, total_live_bytes = 0, total_allocations = 0, total_allocated_bytes = 0;
+     int fd, length, i, frame;
+
+     if(!profile_rate)
+     {
+          errno = EINVAL;
+          return -1;
+     }
+     fd = open(path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+     if(fd < 0)
+          return -1;
+
+     plocklib_acquire_adaptive_lock(&profile_lock);
+     for(i = 0; profile_buckets && i < PALLOC_PROFILE_BUCKETS; i++)
+          if(profile_buckets[i].hash)
+          {
+               total_live += profile_buckets[i].allocations - profile_buckets[i].frees;
+               total_live_bytes += profile_buckets[i].allocated_bytes - profile_buckets[i].freed_bytes;
+               total_allocations += profile_buckets[i].allocations;
+               total_allocated_bytes += profile_buckets[i].allocated_bytes;
+          }
+     length = snprintf(line,sizeof(line),"heap profile: %6lu: %8lu [%6lu: %8lu] @ heap_v2/%ld\n",total_live,total_live_bytes,total_allocations,total_allocated_bytes,profile_rate);
+     profile_write(fd,line,length);
+
+     for(i = 0; profile_buckets && i < PALLOC_PROFILE_BUCKETS; i++)
+     {
+          struct profile_bucket* bucket = profile_buckets + i;
+          if(!bucket->hash)
+               continue;
+          length = snprintf(line,sizeof(line),"%6lu: %8lu [%6lu: %8lu] @",bucket->allocations - bucket->frees,bucket->allocated_bytes - bucket->freed_bytes,bucket->allocations,bucket->allocated_bytes);
+          for(frame = 0; frame < bucket->depth; frame++)
+               length += snprintf(line + length,sizeof(line) - length," 0x%zx",(size_t)(bucket->stack[frame]));
+          line[length++] = '\n';
+          profile_write(fd,line,length);
+     }
+     plocklib_release_adaptive_lock(&profile_lock);
+
+     /*pprof needs the mappings to symbolize.*/
+     profile_write(fd,"\nMAPPED_LIBRARIES:\n",19);
+     int maps = open("/proc/self/maps",O_RDONLY);
+     if(maps >= 0)
+     {
+          while((length = read(maps,line,sizeof(line))) > 0)
+               profile_write(fd,line,length);
+          close(maps);
+     }
+
+     close(fd);
+     return 0;
+}
+
+#endif
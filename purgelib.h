@@ -0,0 +1,244 @@
+#ifndef PURGELIB_H
+#define PURGELIB_H
+
+/*Giving free memory back to the OS.
+
+  Empty superpages in the superpage caches and freed huge mappings in the thread and
+  shared caches stay dirty while they wait to be reused.  Once one has waited
+  purge_decay_ms (PALLOC_DECAY_MS, default PALLOC_DEFAULT_DECAY_MS) it is purged:
+  madvise(MADV_DONTNEED) gives back all but its first page and keeps the mapping, so
+  reusing it costs page faults rather than an mmap.  Superpages of a single page are
+  unmapped instead.
+
+  Nothing is purged on the free() path.  A thread checks whether a purge is due when
+  its chain head fills up or it allocates a huge chunk.  Set PALLOC_PURGE_THREAD to
+  have a background thread check on time as well, for heaps that go quiet.
+
+  malloc_trim() purges everything at once, and also the pages inside partly used
+  superpages that only free chunks cover.  Only its owner may touch a superpage's
+  chunks, so other threads do that part at their next check.*/
+
+#include <time.h>
+
+static int64_t purge_decay_ms = PALLOC_DEFAULT_DECAY_MS; /*-1 for never*/
+static uint64_t next_purge_ms;
+static size_t os_page_size = 4096;
+
+/*Never 0, which marks purged memory.*/
+static inline uint64_t purge_clock_ms()
+{
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC_COARSE,&now);
+     return now.tv_sec*1000UL + now.tv_nsec/1000000 + 1;
+}
+
+/*Purge an empty superpage waiting in its superpage cache and leave it as it was when first mapped,
+  every chunk past the page_record zero and untouched.  The page_record's own page stays, so the rest of it is cleared by hand.*/
+static void purge_empty_superpage(struct page_record* record, int size_class)
+{
+     int usable_entries = min(PALLOC_PAGE_ENTRIES,record->superpage_size / palloc_class_size(size_class));
+
+     madvise((uint8_t*)(record) + os_page_size,record->superpage_size - os_page_size,MADV_DONTNEED);
+     memset((uint8_t*)(record) + sizeof(struct page_record),0,os_page_size - sizeof(struct page_record));
+     memset(record->bitmap,-1,sizeof(record->bitmap));
+     record->nonfull_words = 0;
+     record->untouched_from = record->prefilled_entries - (PALLOC_PAGE_ENTRIES - usable_entries);
+     record->cached_since = 0;
+}
+
+/*Huge mappings are never handed out as zero, so only the link in the first page needs to survive.*/
+static inline void purge_huge_mapping(struct page_record* mapping, int size_class)
+{
+     madvise((uint8_t*)(mapping) + os_page_size,palloc_superpage_size(size_class) - os_page_size,MADV_DONTNEED);
+     mapping->cached_since = 0;
+}
+
+/*Purge what has been in a class's superpage cache since before cutoff.  Returns the bytes given back.*/
+static size_t purge_superpage_cache(int size_class, uint64_t cutoff)
+{
+     struct superpage_cache* cache = superpage_caches + size_class;
+     size_t superpage_size = palloc_superpage_size(size_class);
+     int huge = PALLOC_CLASS_ORDER(size_class) >= PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS;
+     struct page_record* unmapped = NULL;
+     struct page_record* record;
+     size_t purged = 0;
+     int arena;
+
+     if(!*(struct page_record* volatile*)(&cache->empty_superpages) && !*(struct page_record* volatile*)(&cache->arena_superpages))
+          return 0;
+
+     plocklib_acquire_adaptive_lock(&cache->lock);
+     for(arena = 0; arena < 2; arena++)
+     {
+          struct page_record** link = arena ? &cache->arena_superpages : &cache->empty_superpages;
+          while((record = *link))
+          {
+               if(!record->cached_since || record->cached_since > cutoff)
+                    link = &record->chain_forward_ptr;
+               else if(superpage_size <= os_page_size)
+               {
+                    *link = record->chain_forward_ptr;
+                    (*(arena ? &cache->cached_arena_superpages : &cache->cached_superpages))--;
+                    record->chain_forward_ptr = unmapped;
+                    unmapped = record;
+               }
+               else
+               {
+                    if(huge)
+                         purge_huge_mapping(record,size_class);
+                    else
+                         purge_empty_superpage(record,size_class);
+                    purged += superpage_size - os_page_size;
+                    link = &record->chain_forward_ptr;
+               }
+          }
+     }
+     plocklib_release_adaptive_lock(&cache->lock);
+
+     for(; unmapped; unmapped = record)
+     {
+          record = unmapped->chain_forward_ptr;
+          if(tls_thread)
+               tls_thread->counters[size_class].bytes_mapped -= superpage_size;
+          else
+               plocklib_fetch_and_add((uint64_t*)(&unowned_counters[size_class].bytes_mapped),-superpage_size);
+          munmap(unmapped,superpage_size);
+          purged += superpage_size;
+     }
+     return purged;
+}
+
+/*The same for the mappings on a thread's huge class stacks.*/
+static size_t purge_huge_stacks(struct thread_record* thread, uint64_t cutoff)
+{
+     struct page_record* mapping;
+     size_t purged = 0;
+     int size_class;
+
+     if(!*(volatile uint64_t*)(&thread->huge_cached_bytes))
+          return 0;
+
+     plocklib_acquire_adaptive_lock(&thread->huge_lock);
+     for(size_class = PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS << PALLOC_SUBCLASS_BITS; size_class < NUM_PALLOC_BUCKETS; size_class += PALLOC_SUBCLASSES)
+          for(mapping = thread->buckets[size_class]; mapping; mapping = mapping->chain_forward_ptr)
+               if(mapping->cached_since && mapping->cached_since <= cutoff)
+               {
+                    purge_huge_mapping(mapping,size_class);
+                    purged += palloc_superpage_size(size_class) - os_page_size;
+               }
+     plocklib_release_adaptive_lock(&thread->huge_lock);
+     return purged;
+}
+
+/*Purge everything cached since before cutoff, in the shared caches and every thread's huge stacks.*/
+static size_t purge_caches(uint64_t cutoff)
+{
+     int allocated = *(volatile int*)(&allocated_threads);
+     size_t purged = 0;
+     int size_class, index;
+
+     for(size_class = 0; size_class < NUM_PALLOC_BUCKETS; size_class++)
+          purged += purge_superpage_cache(size_class,cutoff);
+     for(index = 1; index < allocated; index++)
+          purged += purge_huge_stacks(thread_record_at(index),cutoff);
+     return purged;
+}
+
+/*Purge what has decayed, if nobody else has since the last interval started.*/
+static void purge_decayed()
+{
+     uint64_t due = *(volatile uint64_t*)(&next_purge_ms);
+     uint64_t now = purge_clock_ms();
+
+     if(now < due || !plocklib_cas64(&next_purge_ms,due,now + max(purge_decay_ms / PALLOC_PURGES_PER_DECAY,1)))
+          return;
+     if(now > (uint64_t)(purge_decay_ms))
+          purge_caches(now - purge_decay_ms);
+}
+
+/*Give back the pages of a superpage of ours that only free chunks cover.
+  Chunks past untouched_from have never been written, so there is nothing to give back there.*/
+static size_t purge_free_chunks(struct page_record* record, int size_class)
+{
+     size_t chunk_size = palloc_class_size(size_class);
+     int chunk, run_start = -1;
+     size_t purged = 0;
+
+     for(chunk = 0; chunk <= record->untouched_from; chunk++)
+     {
+          int is_free = chunk < record->untouched_from && !(record->bitmap[chunk / bits_in(uint64_t)] & (0x8000000000000000UL >> (chunk % bits_in(uint64_t))));
+          if(is_free && run_start < 0)
+               run_start = chunk;
+          else if(!is_free && run_start >= 0)
+          {
+               size_t from = ((size_t)(record) + run_start*chunk_size + os_page_size - 1) & ~(os_page_size - 1);
+               size_t to = ((size_t)(record) + chunk*chunk_size) & ~(os_page_size - 1);
+               if(to > from)
+               {
+                    madvise((void*)(from),to - from,MADV_DONTNEED);
+                    purged += to - from;
+               }
+               run_start = -1;
+          }
+     }
+     return purged;
+}
+
+/*malloc_trim()'s work on our own superpages: everything freed is put back in the bitmaps first.*/
+static size_t trim_thread_heap()
+{
+     struct page_record* record;
+     size_t purged = 0;
+     int size_class, list;
+
+     flush_chunk_caches();
+     flush_remote_batches();
+     if(tls_thread->remote_pages)
+          process_remote_pages();
+
+     for(size_class = 0; PALLOC_CLASS_ORDER(size_class) < PALLOC_HACK_ABSURDLY_HUGE_SIZE_CLASS; size_class++)
+          for(list = 0; list <= PALLOC_PAGE_BINS; list++)
+               for(record = tls_thread->buckets[size_class + NUM_PALLOC_BUCKETS*list]; record; record = record->chain_forward_ptr)
+                    purged += purge_free_chunks(record,size_class);
+     return purged;
+}
+
+/*Called on the allocator's slow paths.*/
+static void purge_if_due()
+{
+     if(unlikely (tls_thread->trim_requested))
+     {
+          tls_thread->trim_requested = 0;
+          trim_thread_heap();
+     }
+     if(purge_decay_ms >= 0)
+          purge_decayed();
+}
+
+static void* purge_thread_main(void* unused)
+{
+     struct timespec interval;
+
+     interval.tv_sec = max(purge_decay_ms / PALLOC_PURGES_PER_DECAY,1) / 1000;
+     interval.tv_nsec = max(purge_decay_ms / PALLOC_PURGES_PER_DECAY,1) % 1000 * 1000000;
+     for(;;)
+     {
+          nanosleep(&interval,NULL);
+          purge_decayed();
+     }
+     return NULL;
+}
+
+static void purge_initialize()
+{
+     const char* decay = getenv("PALLOC_DECAY_MS");
+     pthread_t thread;
+
+     os_page_size = sysconf(_SC_PAGESIZE);
+     if(decay && *decay)
+          purge_decay_ms = max(atol(decay),-1);
+     if(purge_decay_ms >= 0 && getenv("PALLOC_PURGE_THREAD") && !pthread_create(&thread,NULL,purge_thread_main,NULL))
+          pthread_detach(thread);
+}
+
+#endif
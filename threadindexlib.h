@@ -1,124 +1,94 @@
 #ifndef THREADINDEXLIB_H
 #define THREADINDEXLIB_H
 
-#ifndef SPECIALSNOWFLAKE
-#include <dlfcn.h>
-#else
+/*Hands out thread_records.
+
+  A thread gets its record the first time it needs one (normally its first
+  malloc), no matter how it was created, and gives it back when it exits via
+  a pthread key destructor, leaving its superpages to the threads that are
+  still running (see orphan_thread_heap).  The table grows PALLOC_THREAD_CHUNK records at a
+  time, and chunks never move, so page_records can keep pointing into them.*/
+
 #include <pthread.h>
-#endif
 
-static plocklib_simple_t id_lock;
+static plocklib_adaptive_t id_lock;
 static int next_thread_id = 1;
+static int allocated_threads;
 
-struct wrapper_struct
-{
-     void *(*start_routine) (void*);
-     void* arg;
-     int thread_id;
-};
+static pthread_key_t thread_exit_key;
+static int thread_exit_key_created;
 
-static void* wrapped_startthread(void* info_)
+static void release_thread(void* record_)
 {
-     struct wrapper_struct* wrapper_info = (struct wrapper_struct*)(info_);
-
-     void *(*start_routine)(void*) = wrapper_info->start_routine;
-     void* arg = wrapper_info->arg;
-     int thread_id = wrapper_info->thread_id;
-
-     tls_index = thread_id;
-     dbgprintf("new thread tls_index: %d\n",tls_index);
-
-     plocklib_release_simple_lock(&id_lock);
-     plocklib_acquire_simple_lock(&threads[tls_index].threadlock);
-
-     void* to_return = start_routine(arg);
-
-     //Something is rotten in Denmark.
-     //This shouldn't be necessary, and I'm not sure if it actually does anything,
-     //but all multithreaded programs seem to leak memory on Linux, and I noticed
-     //that pthread_exit wasn't being called automatically like it's supposed to be,
-     //so I'm calling it here.
-     //Further investigation is needed, though.
-     pthread_exit(to_return);
+     struct thread_record* record = (struct thread_record*)(record_);
+     dbgprintf("release_thread: tls_index %d\n",tls_index);
+     orphan_thread_heap();
+
+     /*Make ourselves a free thread record.
+       Anything we free after this point counts as a remote free.*/
+     tls_thread = NULL;
+     tls_index = 0;
+     plocklib_release_simple_lock(&record->threadlock);
 }
 
-#ifndef SPECIALSNOWFLAKE
-static int (*real_pthread_create)(pthread_t * thread,
-              const pthread_attr_t * attr,
-              void *(*start_routine)(void*), void * arg) = NULL;
-#else
-static int (*real_pthread_create)(pthread_t * thread,
-              const pthread_attr_t * attr,
-              void *(*start_routine)(void*), void * arg) = pthread_create;
-#endif
-
-#ifndef SPECIALSNOWFLAKE
-static void (*real_pthread_exit)(void* retval) = NULL;
-#else
-static void (*real_pthread_exit)(void* retval) = pthread_exit;
-#endif
-
-static int client_pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine) (void *), void *arg)
+/*Must be called with id_lock held.*/
+static inline void grow_thread_table()
 {
-     int this_thread_id;
+     if(allocated_threads >= PALLOC_MAX_THREADS)
+     {
+          dbgprintf("palloc: more than %d live threads\n",PALLOC_MAX_THREADS);
+          abort();
+     }
 
-     plocklib_acquire_simple_lock(&id_lock);
-     while(threads[next_thread_id].threadlock)
+     struct thread_record* chunk = (struct thread_record*)(mmap(NULL,sizeof(struct thread_record)*PALLOC_THREAD_CHUNK,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0));
+     if(chunk==(struct thread_record*)(-1))
      {
-    	 next_thread_id++;
-    	 next_thread_id%=PALLOC_MAX_THREADS;
+          dbgprintf("palloc: could not map thread records\n");
+          abort();
      }
-     this_thread_id = next_thread_id;
-     next_thread_id++;
-     next_thread_id%=PALLOC_MAX_THREADS;
+     thread_chunks[allocated_threads / PALLOC_THREAD_CHUNK] = chunk;
+     plocklib_storestore_membar();
 
-     static struct wrapper_struct thread_info;
-     thread_info.start_routine = start_routine;
-     thread_info.arg = arg;
-     thread_info.thread_id = this_thread_id;
+     /*Index 0 means "no thread record", so it is never handed out.*/
+     if(!allocated_threads)
+          plocklib_acquire_simple_lock(&chunk->threadlock);
 
-     return real_pthread_create(thread,attr,wrapped_startthread,(void*)(&thread_info));
+     next_thread_id = max(1,allocated_threads);
+     allocated_threads += PALLOC_THREAD_CHUNK;
 }
 
-static void client_pthread_exit(void *retval)
+static void register_thread()
 {
-     dbgprintf("begin client_pthread_exit\n");
-     
-     /*Make ourselves a free thread record*/
-     plocklib_release_simple_lock(&threads[tls_index].threadlock);
-     
-     dbgprintf("end client_pthread_exit\n");
-     real_pthread_exit(retval);
-}
+     int scanned;
 
-#ifndef SPECIALSNOWFLAKE
-int pthread_create(pthread_t * thread,
-		   const pthread_attr_t * attr,
-		   void *(*start_routine)(void*), void * arg)
-{
-     if(!real_pthread_create)
+     plocklib_acquire_adaptive_lock(&id_lock);
+     if(!thread_exit_key_created)
      {
-          real_pthread_create = dlsym(((void *) -1l),"pthread_create");
+          pthread_key_create(&thread_exit_key,release_thread);
+          thread_exit_key_created = 1;
      }
-     
-     return client_pthread_create(thread,attr,start_routine,arg);
-}
-#else
-#define pthread_create client_pthread_create
-#endif
 
-#ifndef SPECIALSNOWFLAKE
-void pthread_exit(void* retval)
-{
-     if(!real_pthread_exit)
+     for(scanned = 0; scanned < allocated_threads; scanned++, next_thread_id++)
      {
-          real_pthread_exit = dlsym(((void *) -1l),"pthread_exit");
+          if(next_thread_id >= allocated_threads)
+               next_thread_id = 1;
+          if(!thread_record_at(next_thread_id)->threadlock)
+               break;
      }
+     if(scanned >= allocated_threads)
+          grow_thread_table();
+
+     tls_index = next_thread_id++;
+     tls_thread = thread_record_at(tls_index);
+     plocklib_acquire_simple_lock(&tls_thread->threadlock);
+     plocklib_release_adaptive_lock(&id_lock);
 
-     client_pthread_exit(retval);
+     if(tls_thread->remote_pages==PALLOC_CLOSED_REMOTE_PAGES)
+          tls_thread->remote_pages = NULL;
+     start_thread_profile();
+
+     dbgprintf("new thread tls_index: %d\n",tls_index);
+     pthread_setspecific(thread_exit_key,tls_thread);
 }
-#else
-#define pthread_exit client_pthread_exit
-#endif
 
 #endif